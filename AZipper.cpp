@@ -33,6 +33,10 @@ string decompressedFileAddress, realCompressedFileAddress, tempFileAddress;
 bool openPopup, processInProgress;
 queue<string> filesToAdd;
 
+const int COMPRESSION_PRESETS[] = {FAST_COMPRESSION, DEFAULT_COMPRESSION, MAX_COMPRESSION, ULTRA_COMPRESSION};
+const unsigned int WINDOW_PRESETS[] = {DEFAULT_WINDOW_SIZE, DEFAULT_WINDOW_SIZE, LARGE_WINDOW_SIZE, LARGE_WINDOW_SIZE};
+int compressionPreset = 1;
+
 struct fileTree {
     vector<pair<string, int>> files;
     fileTree *parent;
@@ -759,7 +763,7 @@ void AddFile(fileTree *&head) {
                         globalProgress.progress = 0;
                         globalProgress.active = true;
 
-                        InsertFile(filesToAdd.front(), tempFileAddress != "" ? tempFileAddress : realCompressedFileAddress, mi, globalProgress.progress);
+                        InsertFile(filesToAdd.front(), tempFileAddress != "" ? tempFileAddress : realCompressedFileAddress, mi, globalProgress.progress, COMPRESSION_PRESETS[compressionPreset]);
                         if(archive_corrupted) {
                             decompressedFileAddress = "ARCHIVE CORRUPTED";
                             realCompressedFileAddress = "";
@@ -819,7 +823,7 @@ void AddFile(fileTree *&head) {
                 {
                     globalProgress.progress = 0;
                     globalProgress.active = true;
-                    Compress({filesToAdd.front()}, tempFileAddress != "" ? tempFileAddress : realCompressedFileAddress, globalProgress.progress);
+                    Compress({filesToAdd.front()}, tempFileAddress != "" ? tempFileAddress : realCompressedFileAddress, globalProgress.progress, COMPRESSION_PRESETS[compressionPreset], DEFAULT_CHUNK_SIZE, false, WINDOW_PRESETS[compressionPreset]);
 
                     if(archive_corrupted) {
                         while(!filesToAdd.empty())
@@ -878,7 +882,7 @@ void AddFile(fileTree *&head) {
                         globalProgress.progress = 0;
                         globalProgress.active = true;
 
-                        InsertFile(filesToAdd.front(), tempFileAddress != "" ? tempFileAddress : realCompressedFileAddress, 0, globalProgress.progress);
+                        InsertFile(filesToAdd.front(), tempFileAddress != "" ? tempFileAddress : realCompressedFileAddress, 0, globalProgress.progress, COMPRESSION_PRESETS[compressionPreset]);
                         if(archive_corrupted) {
                             while(!filesToAdd.empty())
                                 filesToAdd.pop();
@@ -950,7 +954,7 @@ void AddFile(fileTree *&head) {
                 globalProgress.progress = 0;
                 globalProgress.active = true;
 
-                Compress({filesToAdd.front()}, tempFileAddress, globalProgress.progress);
+                Compress({filesToAdd.front()}, tempFileAddress, globalProgress.progress, COMPRESSION_PRESETS[compressionPreset], DEFAULT_CHUNK_SIZE, false, WINDOW_PRESETS[compressionPreset]);
                 if(archive_corrupted) {
                     while(!filesToAdd.empty())
                         filesToAdd.pop();
@@ -987,7 +991,7 @@ void AddFile(fileTree *&head) {
                     globalProgress.progress = 0;
                     globalProgress.active = true;
 
-                    InsertFile(filesToAdd.front(), tempFileAddress != "" ? tempFileAddress : realCompressedFileAddress, 0, globalProgress.progress);
+                    InsertFile(filesToAdd.front(), tempFileAddress != "" ? tempFileAddress : realCompressedFileAddress, 0, globalProgress.progress, COMPRESSION_PRESETS[compressionPreset]);
                     if(archive_corrupted) {
                         while(!filesToAdd.empty())
                             filesToAdd.pop();
@@ -1336,12 +1340,42 @@ int main(int argc, char *argv[])
             DeleteContent(head);
         }
 
+        ImGui::SameLine();
+        if (ImGui::Button("Compact") && head != nullptr && !globalProgress.active) {
+            globalProgress.progress = 0;
+            globalProgress.active = true;
+            processInProgress = true;
+
+            thread t([&head]()
+            {
+                CompactArchive(tempFileAddress != "" ? tempFileAddress : realCompressedFileAddress, globalProgress.progress);
+                if(archive_corrupted) {
+                    decompressedFileAddress = "ARCHIVE CORRUPTED";
+                    realCompressedFileAddress = "";
+                    head = nullptr;
+                }
+            });
+
+            t.detach();
+        }
+        if (ImGui::IsItemHovered())
+            ImGui::SetTooltip("Give back the space left in the archive by deleted and inserted files");
+
         ImGui::SameLine();
         if (ImGui::Button("Deselect")) {
             selectedIndices.clear();
             lastSelectedIndex.clear();
         }
 
+        ImGui::SameLine();
+        ImGui::PushStyleColor(ImGuiCol_FrameBg, ImVec4(0.1f, 0.1f, 0.1f, 1.0f));
+        ImGui::PushStyleColor(ImGuiCol_FrameBgHovered, ImVec4(0.18f, 0.18f, 0.18f, 1.0f));
+        ImGui::SetNextItemWidth(80);
+        ImGui::Combo("##CompressionLevel", &compressionPreset, "Fast\0Default\0Max\0Ultra\0");
+        if (ImGui::IsItemHovered())
+            ImGui::SetTooltip("Compression level");
+        ImGui::PopStyleColor(2);
+
         ImGui::SameLine();
         if (ImGui::Button("Exit")) {
             if (tempFileAddress != "" && showPopup) {
@@ -2,46 +2,167 @@
 #include "Globals.h"
 #include "Utils.h"
 
-bool &archive_corrupted = archive_corrupted_help;
+atomic<bool> &archive_corrupted = archive_corrupted_help;
 float *progress, progress_ratio;
+mutex progress_mutex;
 
 //------------------------------------------------ COMPRESSING ALGORITHM ------------------------------------------------------------
 
-HuffmanNode* BuildHuffmanTree(const vector<uint64_t> &freqMap, const int &size) {
-    priority_queue<HuffmanNode*, vector<HuffmanNode*>, function<bool(HuffmanNode*, HuffmanNode*)>> heap(
-        [](HuffmanNode* a, HuffmanNode* b) { return a->frequency > b->frequency || (a->frequency == b->frequency && a->value > b->value); }
-    );
+//package-merge: the lengths of the cheapest code without codes longer than maxLength, for the rare tables where Huffman goes deeper
+//list d holds the leaves merged with the pairs of list d - 1; the first 2n - 2 items of the last list are the chosen ones, and an item
+//chosen from a list adds one bit to every symbol it holds, so only how many of each list are taken has to be followed
+void LimitCodeLengths(const pair<uint64_t, int> leaves[], const int &n, const int &maxLength, vector<int> &codeLengths) {
+    vector<vector<pair<uint64_t, int>>> lists(maxLength);
+    lists[0].assign(leaves, leaves + n);
+
+    for(int d = 1; d < maxLength; d++) {
+        const vector<pair<uint64_t, int>> &previous = lists[d - 1];
+        vector<pair<uint64_t, int>> &list = lists[d];
+        list.reserve(n + previous.size() / 2);
+
+        //pairs are marked with -1, a leaf goes first when the weights are equal
+        size_t leaf = 0, pair = 0;
+        while(leaf < static_cast<size_t>(n) || pair + 1 < previous.size()) {
+            uint64_t pairWeight = pair + 1 < previous.size() ? previous[pair].first + previous[pair + 1].first : UINT64_MAX;
+
+            if(leaf < static_cast<size_t>(n) && leaves[leaf].first <= pairWeight)
+                list.push_back(leaves[leaf++]);
+            else {
+                list.push_back({pairWeight, -1});
+                pair += 2;
+            }
+        }
+    }
+
+    size_t taken = 2 * n - 2;
+    for(int d = maxLength - 1; d >= 0; d--) {
+        size_t pairs = 0;
+        for(size_t i = 0; i < taken; i++) {
+            if(lists[d][i].second >= 0)
+                codeLengths[lists[d][i].second]++;
+            else
+                pairs++;
+        }
+
+        taken = 2 * pairs;
+    }
+}
+
+//the Huffman code lengths of the symbols, computed in place (Moffat and Katajainen): the used symbols sorted by frequency
+//are merged like two queues in a single array, which then holds the parent of every internal node, then the depth of every
+//internal node and at last the length of every symbol; nothing is allocated besides the result
+vector<int> HuffmanCodeLengths(const vector<uint64_t> &freqMap, const int &size, const int &maxLength = MAX_CODE_LENGTH) {
+    vector<int> codeLengths(size, 0);
 
+    pair<uint64_t, int> leaves[HUFFMAN_MAX_SYMBOLS];
+    int n = 0;
     for(int i = 0; i < size; i++)
         if(freqMap[i] > 0)
-            heap.push(new HuffmanNode(i, freqMap[i]));
+            leaves[n++] = {freqMap[i], i};
 
-    if(heap.empty())
-        return nullptr;
-    
-    while(heap.size() > 1) {
-        HuffmanNode* left = heap.top();
-        heap.pop();
+    if(n == 0)
+        return codeLengths;
 
-        HuffmanNode* right = heap.top();
-        heap.pop();
+    //a single symbol still needs a 1 bit code
+    if(n == 1) {
+        codeLengths[leaves[0].second] = 1;
+        return codeLengths;
+    }
+
+    sort(leaves, leaves + n);
+
+    uint64_t A[HUFFMAN_MAX_SYMBOLS] = {};
+    for(int i = 0; i < n; i++)
+        A[i] = leaves[i].first;
+
+    //left to right: A[next] becomes the weight of the next internal node, the nodes it takes get its index as parent
+    uint64_t root = 0, leaf = 2;
+    A[0] += A[1];
+    for(uint64_t next = 1; next < static_cast<uint64_t>(n - 1); next++) {
+        if(leaf >= static_cast<uint64_t>(n) || A[root] < A[leaf]) {
+            A[next] = A[root];
+            A[root++] = next;
+        }
+        else
+            A[next] = A[leaf++];
 
-        heap.push(new HuffmanNode(0, left->frequency + right->frequency, left, right));
+        if(leaf >= static_cast<uint64_t>(n) || (root < next && A[root] < A[leaf])) {
+            A[next] += A[root];
+            A[root++] = next;
+        }
+        else
+            A[next] += A[leaf++];
     }
 
-    return heap.top();
-}
+    //right to left: the depth of every internal node is one more than the depth of its parent
+    A[n - 2] = 0;
+    for(int next = n - 3; next >= 0; next--)
+        A[next] = A[A[next]] + 1;
+
+    //right to left: the nodes at each depth that are not internal are leaves, the rarest symbols get the deepest ones
+    int available = 1, used = 0, depth = 0, internal = n - 2, next = n - 1;
+    while(available > 0) {
+        while(internal >= 0 && A[internal] == static_cast<uint64_t>(depth)) {
+            used++;
+            internal--;
+        }
+        while(available > used) {
+            A[next--] = depth;
+            available--;
+        }
 
-void ExtractCodeLengths(HuffmanNode* root, int depth, vector<int>& codeLengths) {
-    if (!root) return;
+        available = 2 * used;
+        depth++;
+        used = 0;
+    }
 
-    if (!root->left && !root->right) {
-        codeLengths[root->value] = depth;
-        return;
+    //the rarest symbol has the longest code
+    if(A[0] <= static_cast<uint64_t>(maxLength)) {
+        for(int i = 0; i < n; i++)
+            codeLengths[leaves[i].second] = static_cast<int>(A[i]);
+
+        return codeLengths;
+    }
+
+    LimitCodeLengths(leaves, n, maxLength, codeLengths);
+
+    return codeLengths;
+}
+
+//the predefined tables of fixed blocks, the same lengths as in Deflate (offsets get as many bits as their largest code needs)
+vector<int> FixedCodeLengths(const int &size) {
+    vector<int> codeLengths(size, BitsNeeded(size - 1));
+    if(size != 286)
+        return codeLengths;
+
+    for(int i = 0; i < size; i++) {
+        if(i <= 143)
+            codeLengths[i] = 8;
+        else if(i <= 255)
+            codeLengths[i] = 9;
+        else if(i <= 279)
+            codeLengths[i] = 7;
+        else
+            codeLengths[i] = 8;
     }
 
-    ExtractCodeLengths(root->left, depth + 1, codeLengths);
-    ExtractCodeLengths(root->right, depth + 1, codeLengths);
+    return codeLengths;
+}
+
+vector<pair<int, int>> GenerateCanonicalHuffmanCodes(const vector<int>& codeLengths, const int &size);
+
+//the fixed codes of the literal/length alphabet (286) or of an offset alphabet
+const vector<pair<int, int>>& FixedCodes(const int &size) {
+    static const vector<vector<pair<int, int>>> codes = [] {
+        vector<vector<pair<int, int>>> codes(287);
+        codes[286] = GenerateCanonicalHuffmanCodes(FixedCodeLengths(286), 286);
+        for(int i = 2 * WINDOW_LOG; i <= MAX_OFFSET_CODES; i += 2)
+            codes[i] = GenerateCanonicalHuffmanCodes(FixedCodeLengths(i), i);
+
+        return codes;
+    }();
+
+    return codes[size];
 }
 
 vector<pair<int, int>> GenerateCanonicalHuffmanCodes(const vector<int>& codeLengths, const int &size) {
@@ -77,356 +198,714 @@ vector<pair<int, int>> GenerateCanonicalHuffmanCodes(const vector<int>& codeLeng
     return canonicalCodes;
 }
 
-void GetLZ77Frequency(const string &address, vector<uint64_t> &lengthFreqMap, vector<uint64_t> &offsetFreqMap) {
-    ifstream file(address, ios::binary | ios::ate);
-    uint64_t fileSize = 0, abs_pos = 0, search_buffer_pos = 0, lookahead_buffer_pos = 0;
-    if(!file.is_open()) {
-        cerr << "Error opening file: " << address << endl;
-        file.close();
+int LengthSymbol(const LZ77 &token) {
+    if(token.length == 0 && token.offset == 0)
+        return token.character;
+
+    if(token.length < MIN_MATCH || token.length > LOOKAHEAD_SIZE)
+        return -1;
+
+    return LENGTH_CODES[token.length].symbol;
+}
+
+//dropping the lowest 8 bits of an offset moves it 16 symbols lower, so 512 entries cover every window
+int OffsetSymbol(const uint32_t &offset) {
+    if(offset == 0 || offset > (1u << MAX_WINDOW_LOG))
+        return -1;
+
+    uint32_t distance = offset - 1;
+    if(distance < 512)
+        return OFFSET_SYMBOLS[distance];
+    if(distance < (1u << 17))
+        return OFFSET_SYMBOLS[distance >> 8] + 16;
+
+    return OFFSET_SYMBOLS[distance >> 16] + 32;
+}
+
+//the smallest offset of a code
+uint32_t OffsetBase(const int &symbol) {
+    return OFFSET_BASES[symbol].base;
+}
+
+void AddToken(TokenBuffer &tokens, const LZ77 &token, vector<uint64_t> &lengthFreqMap, vector<uint64_t> &offsetFreqMap) {
+    PushToken(tokens, PackToken(token));
+
+    int symbol = LengthSymbol(token);
+    if(symbol < 0) {
+        cerr << "Error: Length " << token.length << " exceeds maximum expected length." << endl;
         archive_corrupted = true;
         return;
     }
+    lengthFreqMap[symbol]++;
 
-    streampos pos = file.tellg();
-    file.seekg(0, ios::beg);
-    fileSize = static_cast<uint64_t>(pos);
-    
-    ofstream outFile(tempFileName, ios::binary);
-    if(!outFile) {
+    if(token.offset == 0)
+        return;
+
+    symbol = OffsetSymbol(token.offset);
+    if(symbol < 0) {
+        cerr << "Error: Offset " << token.offset << " exceeds maximum expected offset." << endl;
         archive_corrupted = true;
-        file.close();
         return;
     }
-    writeBufferIndex_2 = 0;
-    byteIndex_2 = 0;
+    offsetFreqMap[symbol]++;
+}
 
-    unsigned char search_buffer[WINDOW_SIZE], lookahead_buffer[LOOKAHEAD_SIZE];
-    unsigned char byte;
-    unordered_map<uint32_t, deque<uint64_t>> hashTable;
-    hashTable.reserve(MOD);
-    uint32_t hash;
+//the binary tree finder keeps the positions with the same hash in a binary search tree ordered by the bytes that follow them,
+//newest at the root; pos becomes the new root and the old tree is split around it on the way down, so every node visited
+//is a match candidate and the search ends after about log(n) nodes instead of walking the whole chain
+template<int HASH_BITS, int HASH_BYTES>
+int FindTreeMatch(HashChain &chain, const CompressionLevel &config, const uint64_t &pos, const uint64_t &windowStart, const uint64_t &dataEnd, int bestLength, int depth, uint32_t &offset, vector<pair<uint16_t, uint32_t>> *matches) {
+    unsigned char *window = chain.window.data();
+    const unsigned char *scan = window + (pos - windowStart);
+    uint32_t h = Hash<HASH_BITS, HASH_BYTES>(scan);
+    uint64_t cur = chain.head[h];
+    chain.head[h] = pos + 1;
+
+    //the children of a position are stored as distances, the left one first; the smaller strings go to the left
+    //leftLink is the free child where the next smaller node goes, rightLink the one for the next larger node
+    const uint64_t mask = chain.windowSize - 1;
+    uint64_t leftNode = pos, rightNode = pos;
+    uint32_t *leftLink = &chain.prev[2 * (pos & mask)], *rightLink = &chain.prev[2 * (pos & mask) + 1];
+    int leftLength = 0, rightLength = 0;
+
+    //strings equal up to niceLength are treated as equal, pos then replaces the older one in the tree
+    const int maxLength = static_cast<int>(min<uint64_t>(config.niceLength, dataEnd - pos));
+    int best = bestLength;
+    uint64_t period = 0;
+    int periodLength = 0;
+
+    auto child = [&](const uint64_t &node, const uint32_t &distance) -> uint64_t {
+        return distance == 0 ? 0 : node - distance + 1;
+    };
+    auto link = [&](const uint64_t &node, const uint64_t &next) -> uint32_t {
+        return next == 0 || node - (next - 1) >= chain.windowSize ? 0 : static_cast<uint32_t>(node - (next - 1));
+    };
 
-    file.read(reinterpret_cast<char*>(search_buffer), WINDOW_SIZE);
-    search_buffer_pos = static_cast<uint64_t>(file.gcount());
+    while(cur != 0 && depth-- > 0) {
+        uint64_t match_pos = cur - 1;
+        uint64_t distance = pos - match_pos;
+        if(distance >= chain.windowSize)
+            break;
 
-    file.read(reinterpret_cast<char*>(lookahead_buffer), LOOKAHEAD_SIZE);
-    lookahead_buffer_pos = static_cast<uint64_t>(file.gcount());
-    abs_pos = search_buffer_pos + lookahead_buffer_pos;
+        //both sides of the path share a prefix with pos, so the comparison starts after the shorter one
+        const unsigned char *match = window + (match_pos - windowStart);
+        int length = min(leftLength, rightLength);
+        length += MatchLength(match + length, scan + length, maxLength - length);
 
-    for(int i = 0; i < search_buffer_pos; i++) {
-        if(i > search_buffer_pos - MIN_MATCH) {
-            lengthFreqMap[search_buffer[i]]++;
+        //a match can not overlap the bytes it encodes
+        int usable = static_cast<int>(min<uint64_t>(length, distance));
+        if(usable > best) {
+            best = usable;
+            offset = static_cast<uint32_t>(distance);
+            if(matches)
+                matches->push_back({static_cast<uint16_t>(best), offset});
+        }
+        if(length > static_cast<int>(distance) && length > periodLength) {
+            period = distance;
+            periodLength = length;
+        }
 
-            WriteToBuffer_2(outFile, search_buffer[i]);
-            WriteToBufferBig_2(outFile, 0, 9);
+        uint32_t *children = &chain.prev[2 * (match_pos & mask)];
+        if(length == maxLength) {
+            *leftLink = link(leftNode, child(match_pos, children[0]));
+            *rightLink = link(rightNode, child(match_pos, children[1]));
 
-            continue;
+            leftLink = rightLink = nullptr;
+            break;
+        }
+
+        if(match[length] < scan[length]) {
+            *leftLink = link(leftNode, cur);
+            leftNode = match_pos;
+            leftLink = &children[1];
+            leftLength = length;
+            cur = child(match_pos, children[1]);
+        }
+        else {
+            *rightLink = link(rightNode, cur);
+            rightNode = match_pos;
+            rightLink = &children[0];
+            rightLength = length;
+            cur = child(match_pos, children[0]);
+        }
+    }
+
+    //the subtrees past the search depth or the window are dropped
+    if(leftLink) {
+        *leftLink = 0;
+        *rightLink = 0;
+    }
+
+    //in a run that repeats every few bytes only the newest copy is in the tree, the same bytes a whole number of periods
+    //back are the closest match that does not overlap
+    if(period != 0) {
+        uint64_t distance = (periodLength + period - 1) / period * period;
+        if(distance < chain.windowSize && distance <= pos - windowStart) {
+            int length = MatchLength(scan - distance, scan, static_cast<int>(min<uint64_t>(maxLength, distance)));
+            if(length > best) {
+                best = length;
+                offset = static_cast<uint32_t>(distance);
+                if(matches)
+                    matches->push_back({static_cast<uint16_t>(best), offset});
+            }
         }
+    }
 
-        LZ77 token = {0, 0, search_buffer[i]};
-        uint32_t h = Hash(search_buffer, i);
+    if(best == MIN_MATCH && bestLength < MIN_MATCH && offset > TOO_FAR)
+        return 0;
 
-        if(hashTable.count(h)) {
-            for(uint64_t match_pos : hashTable[h]) {
-                uint16_t match_length = 0;
-                while(i + match_length < search_buffer_pos && match_pos + match_length < i && match_length < LOOKAHEAD_SIZE && search_buffer[i + match_length] == search_buffer[match_pos + match_length])
-                    match_length++;
-                
-                if(match_length > token.length && match_length >= MIN_MATCH) {
-                    token.offset = i - match_pos;
-                    token.length = match_length;
-                    token.character = '-';
-
-                    if(token.offset < MIN_MATCH || token.offset > WINDOW_SIZE) {
-                        cerr << "Error: Offset " << token.offset << " is out of bounds at abs_pos = " << abs_pos << endl;
-                        archive_corrupted = true;
-                        file.close();
-                        outFile.close();
-                        return;
-                    }
-                    if(token.length < MIN_MATCH || token.length > LOOKAHEAD_SIZE) {
-                        cerr << "Error: Length " << token.length << " is less than MIN_MATCH at abs_pos = " << abs_pos << endl;
-                        archive_corrupted = true;
-                        file.close();
-                        outFile.close();
-                        return;
-                    }
-                    if(token.offset < token.length) {
-                        cerr << "Error: Offset " << token.offset << " is less than Length " << token.length << " at abs_pos = " << abs_pos << endl;
-                        archive_corrupted = true;
-                        file.close();
-                        outFile.close();
-                        return;
-                    }
+    return best;
+}
 
-                    if(token.length == LOOKAHEAD_SIZE)
-                        break;
-                }
+//adds pos to the hash chain (or tree) and returns the longest match (longer than bestLength) that starts before it
+//every longer match found on the way is also added to matches when it is given
+template<int HASH_BITS, int HASH_BYTES, bool BINARY_TREE>
+int FindMatch(HashChain &chain, const CompressionLevel &config, const uint64_t &pos, const uint64_t &windowStart, const uint64_t &dataEnd, int bestLength, int chainLength, uint32_t &offset, vector<pair<uint16_t, uint32_t>> *matches = nullptr) {
+    if(pos + HASH_BYTES > dataEnd)
+        return 0;
+
+    if constexpr(BINARY_TREE)
+        return FindTreeMatch<HASH_BITS, HASH_BYTES>(chain, config, pos, windowStart, dataEnd, bestLength, chainLength, offset, matches);
+
+    unsigned char *window = chain.window.data();
+    uint32_t h = Hash<HASH_BITS, HASH_BYTES>(window + (pos - windowStart));
+    uint64_t cur = chain.head[h];
+    InsertHashChain(chain, h, pos);
+
+    //a match can not overlap the bytes it encodes
+    const unsigned char *scan = window + (pos - windowStart);
+    int maxLength = static_cast<int>(min<uint64_t>(LOOKAHEAD_SIZE, dataEnd - pos));
+    int best = bestLength;
+
+    while(cur != 0 && chainLength-- > 0) {
+        uint64_t match_pos = cur - 1;
+        uint64_t distance = pos - match_pos;
+        if(distance > chain.windowSize)
+            break;
+
+        int limit = static_cast<int>(min<uint64_t>(maxLength, distance));
+        const unsigned char *match = window + (match_pos - windowStart);
+
+        if(limit > best && match[best] == scan[best]) {
+            int match_length = MatchLength(match, scan, limit);
+
+            if(match_length > best) {
+                best = match_length;
+                offset = static_cast<uint32_t>(distance);
+                if(matches)
+                    matches->push_back({static_cast<uint16_t>(best), offset});
+
+                if(best >= config.niceLength)
+                    break;
             }
         }
 
-        if(i >= MIN_MATCH)
-            hashTable[Hash(search_buffer, i - MIN_MATCH)].push_back(i - MIN_MATCH);
+        uint32_t step = chain.prev[match_pos & (chain.windowSize - 1)];
+        if(step == 0)
+            break;
+        cur -= step;
+    }
 
-        WriteToBuffer_2(outFile, token.character);
-        if(token.length == 0)
-            WriteToBufferBig_2(outFile, 0, 9);
-        else {
-            WriteToBufferBig_2(outFile, token.length, 9);
-            WriteToBufferBig_2(outFile, token.offset, 16);
-        }
+    //a short match far away costs more than its literals
+    if(best == MIN_MATCH && bestLength < MIN_MATCH && offset > TOO_FAR)
+        return 0;
 
-        if(token.length == 0 && token.offset == 0)
-            lengthFreqMap[token.character]++;
-        else {
-            if(token.length <= 10)
-                lengthFreqMap[257 + token.length - 3]++;
-            else if(token.length <= 18)
-                lengthFreqMap[265 + (token.length - 11) / 2]++;
-            else if(token.length <= 34)
-                lengthFreqMap[269 + (token.length - 19) / 4]++;
-            else if(token.length <= 66)
-                lengthFreqMap[273 + (token.length - 35) / 8]++;
-            else if(token.length <= 130)
-                lengthFreqMap[277 + (token.length - 67) / 16]++;
-            else if(token.length <= 257)
-                lengthFreqMap[281 + (token.length - 131) / 32]++;
-            else if(token.length == 258)
-                lengthFreqMap[285]++;
-            else {
-                cerr << "Error: Length " << token.length << " exceeds maximum expected length." << endl;
-                archive_corrupted = true;
-                file.close();
-                outFile.close();
-                return;
+    return best;
+}
+
+//adds a position that is not searched for a match, a tree still has to be searched to place it
+template<int HASH_BITS, int HASH_BYTES, bool BINARY_TREE>
+void InsertPosition(HashChain &chain, const CompressionLevel &config, const uint64_t &pos, const uint64_t &windowStart, const uint64_t &dataEnd) {
+    if(pos + HASH_BYTES > dataEnd)
+        return;
+
+    if constexpr(BINARY_TREE) {
+        uint32_t offset = 0;
+        FindTreeMatch<HASH_BITS, HASH_BYTES>(chain, config, pos, windowStart, dataEnd, LOOKAHEAD_SIZE, config.maxChain, offset, nullptr);
+    }
+    else
+        InsertHashChain(chain, Hash<HASH_BITS, HASH_BYTES>(chain.window.data() + (pos - windowStart)), pos);
+}
+
+template<int HASH_BITS, int HASH_BYTES, bool BINARY_TREE>
+void FindTokens(const FileChunk &chunk, HashChain &chain, TokenBuffer &tokens, const CompressionLevel &config, vector<uint64_t> &lengthFreqMap, vector<uint64_t> &offsetFreqMap) {
+    ifstream file(chunk.address, ios::binary);
+    if(!file.is_open()) {
+        cerr << "Error opening file: " << chunk.address << endl;
+        file.close();
+        archive_corrupted = true;
+        return;
+    }
+    file.seekg(static_cast<streamoff>(chunk.start - chunk.dictionary));
+
+    ResetHashChain(chain, HASH_BITS, archiveHeader.WindowSize(), BINARY_TREE);
+    ClearTokenBuffer(tokens);
+
+    //window[0] holds the byte at position windowStart, the data read so far ends at position dataEnd
+    //positions count from the start of the dictionary, the chunk itself ends at position chunkEnd
+    unsigned char *window = chain.window.data();
+    const uint64_t windowSize = chain.window.size();
+    const uint64_t chunkEnd = chunk.length == UINT64_MAX ? UINT64_MAX : chunk.dictionary + chunk.length;
+    uint64_t windowStart = 0, dataEnd = 0, pos = 0, nextInsert = 0;
+    bool end_of_file = false;
+
+    int length = 0, nextLength;
+    uint32_t offset = 0, nextOffset = 0;
+    bool matchKnown = false;
+
+    while(!archive_corrupted) {
+        while(!end_of_file && dataEnd - pos < MIN_LOOKAHEAD) {
+            //keep the last chain.windowSize bytes before pos, drop the rest
+            if(dataEnd - windowStart == windowSize) {
+                uint64_t shift = pos - chain.windowSize - windowStart;
+                memmove(window, window + shift, dataEnd - windowStart - shift);
+                windowStart += shift;
             }
+
+            file.read(reinterpret_cast<char*>(window + (dataEnd - windowStart)), min(windowSize - (dataEnd - windowStart), chunkEnd - dataEnd));
+            dataEnd += static_cast<uint64_t>(file.gcount());
+
+            if(file.gcount() == 0 || dataEnd == chunkEnd)
+                end_of_file = true;
         }
 
-        if(token.offset == 0) {
-            //do nothing
-        }
-        else if(token.offset <= 4)
-            offsetFreqMap[token.offset - 1]++;
-        else if(token.offset <= 8)
-            offsetFreqMap[4 + (token.offset - 5) / 2]++;
-        else if(token.offset <= 16)
-            offsetFreqMap[6 + (token.offset - 9) / 4]++;
-        else if(token.offset <= 32)
-            offsetFreqMap[8 + (token.offset - 17) / 8]++;
-        else if(token.offset <= 64)
-            offsetFreqMap[10 + (token.offset - 33) / 16]++;
-        else if(token.offset <= 128)
-            offsetFreqMap[12 + (token.offset - 65) / 32]++;
-        else if(token.offset <= 256)
-            offsetFreqMap[14 + (token.offset - 129) / 64]++;
-        else if(token.offset <= 512)
-            offsetFreqMap[16 + (token.offset - 257) / 128]++;
-        else if(token.offset <= 1024)
-            offsetFreqMap[18 + (token.offset - 513) / 256]++;
-        else if(token.offset <= 2048)
-            offsetFreqMap[20 + (token.offset - 1025) / 512]++;
-        else if(token.offset <= 4096)
-            offsetFreqMap[22 + (token.offset - 2049) / 1024]++;
-        else if(token.offset <= 8192)
-            offsetFreqMap[24 + (token.offset - 4097) / 2048]++;
-        else if(token.offset <= 16384)
-            offsetFreqMap[26 + (token.offset - 8193) / 4096]++;
-        else if(token.offset <= 32768)
-            offsetFreqMap[28 + (token.offset - 16385) / 8192]++;
-        else {
-            cerr << "Error: Offset " << token.offset << " exceeds maximum expected offset." << endl;
-            archive_corrupted = true;
-            file.close();
-            outFile.close();
-            return;
+        if(pos == dataEnd)
+            break;
+
+        //the dictionary is only added to the hash chain
+        if(pos < chunk.dictionary) {
+            InsertPosition<HASH_BITS, HASH_BYTES, BINARY_TREE>(chain, config, pos, windowStart, dataEnd);
+            pos++;
+            nextInsert = pos;
+
+            continue;
         }
-        
-        for (int j = 1; j < token.length; j++)
-            if(i + j < search_buffer_pos - MIN_MATCH)
-                hashTable[Hash(search_buffer, i + j - MIN_MATCH)].push_back(i + j - MIN_MATCH);
-        
-        if(token.length > 0)
-            i += (token.length - 1);
-    }
 
-    uint64_t mi = lookahead_buffer_pos;
-    if(1LL * mi > LOOKAHEAD_SIZE)
-        mi = LOOKAHEAD_SIZE;
-    mi += fileSize;
+        if(!matchKnown)
+            length = FindMatch<HASH_BITS, HASH_BYTES, BINARY_TREE>(chain, config, pos, windowStart, dataEnd, MIN_MATCH - 1, config.maxChain, offset);
+        matchKnown = false;
 
-    if(lookahead_buffer_pos < LOOKAHEAD_SIZE)
-        lookahead_buffer_pos = 0;
+        if(length < MIN_MATCH) {
+            AddToken(tokens, {0, 0, window[pos - windowStart]}, lengthFreqMap, offsetFreqMap);
+            pos++;
+            nextInsert = pos;
 
-    unsigned char bytes[READ_BUFFER_SIZE];
-    int bytesLength, bytesLengthIdx;
-    ReadDataToCompress(bytes, bytesLength, bytesLengthIdx, file);
+            continue;
+        }
 
-    while(abs_pos < mi) {
-        LZ77 token = {0, 0, lookahead_buffer[lookahead_buffer_pos % LOOKAHEAD_SIZE]};
-        uint32_t h = Hash(lookahead_buffer, lookahead_buffer_pos, LOOKAHEAD_SIZE);
+        //lazy evaluation: emit a literal instead if the next position (or the one after it) has a longer match
+        if(config.lazySteps >= 1 && length < config.maxLazy) {
+            int chainLength = length >= config.goodLength ? config.maxChain >> 2 : config.maxChain;
 
-        if(hashTable.count(h)) {
-            for(uint64_t match_pos : hashTable[h]) {
-                if(search_buffer_pos - match_pos >= WINDOW_SIZE)
-                    continue;
-                
-                uint16_t match_length = 0;
-                while(match_pos + match_length < search_buffer_pos && abs_pos + match_length < fileSize && search_buffer[(match_pos + match_length) % WINDOW_SIZE] == lookahead_buffer[(lookahead_buffer_pos + match_length) % LOOKAHEAD_SIZE] && match_length < LOOKAHEAD_SIZE)
-                    match_length++;
-                
-                if(match_length > token.length && match_length >= MIN_MATCH) {
-                    token.offset = search_buffer_pos - match_pos;
-                    token.length = match_length;
-                    token.character = '-';
-                    
-                    if(token.offset < MIN_MATCH || token.offset > WINDOW_SIZE) {
-                        cerr << "Error: Offset " << token.offset << " is out of bounds at abs_pos = " << abs_pos << endl;
-                        archive_corrupted = true;
-                        file.close();
-                        outFile.close();
-                        return;
-                    }
-                    if(token.length < MIN_MATCH || token.length > LOOKAHEAD_SIZE) {
-                        cerr << "Error: Length " << token.length << " is less than MIN_MATCH at abs_pos = " << abs_pos << endl;
-                        archive_corrupted = true;
-                        file.close();
-                        outFile.close();
-                        return;
-                    }
-                    if(token.offset < token.length) {
-                        cerr << "Error: Offset " << token.offset << " is less than Length " << token.length << " at abs_pos = " << abs_pos << endl;
-                        archive_corrupted = true;
-                        file.close();
-                        outFile.close();
-                        return;
-                    }
+            nextLength = FindMatch<HASH_BITS, HASH_BYTES, BINARY_TREE>(chain, config, pos + 1, windowStart, dataEnd, length, chainLength, nextOffset);
+            if(nextLength > length) {
+                AddToken(tokens, {0, 0, window[pos - windowStart]}, lengthFreqMap, offsetFreqMap);
+                pos++;
 
+                length = nextLength;
+                offset = nextOffset;
+                matchKnown = true;
+                nextInsert = pos + 1;
 
-                    if(token.length == LOOKAHEAD_SIZE)
-                        break;
+                continue;
+            }
+
+            if(config.lazySteps >= 2) {
+                nextLength = FindMatch<HASH_BITS, HASH_BYTES, BINARY_TREE>(chain, config, pos + 2, windowStart, dataEnd, length + 1, chainLength, nextOffset);
+                if(nextLength > length + 1) {
+                    AddToken(tokens, {0, 0, window[pos - windowStart]}, lengthFreqMap, offsetFreqMap);
+                    AddToken(tokens, {0, 0, window[pos + 1 - windowStart]}, lengthFreqMap, offsetFreqMap);
+                    pos += 2;
+
+                    length = nextLength;
+                    offset = nextOffset;
+                    matchKnown = true;
+                    nextInsert = pos + 1;
+
+                    continue;
                 }
+
+                nextInsert = pos + 3;
             }
+            else
+                nextInsert = pos + 2;
         }
+        else
+            nextInsert = pos + 1;
 
-        WriteToBuffer_2(outFile, token.character);
-        if(token.length == 0)
-            WriteToBufferBig_2(outFile, 0, 9);
-        else {
-            WriteToBufferBig_2(outFile, token.length, 9);
-            WriteToBufferBig_2(outFile, token.offset, 16);
-        }
+        AddToken(tokens, {offset, static_cast<uint16_t>(length), '-'}, lengthFreqMap, offsetFreqMap);
 
-        if(token.length == 0 && token.offset == 0)
-            lengthFreqMap[token.character]++;
-        else {
-            if(token.length <= 10)
-                lengthFreqMap[257 + token.length - 3]++;
-            else if(token.length <= 18)
-                lengthFreqMap[265 + (token.length - 11) / 2]++;
-            else if(token.length <= 34)
-                lengthFreqMap[269 + (token.length - 19) / 4]++;
-            else if(token.length <= 66)
-                lengthFreqMap[273 + (token.length - 35) / 8]++;
-            else if(token.length <= 130)
-                lengthFreqMap[277 + (token.length - 67) / 16]++;
-            else if(token.length <= 257)
-                lengthFreqMap[281 + (token.length - 131) / 32]++;
-            else if(token.length == 258)
-                lengthFreqMap[285]++;
-            else {
-                cerr << "Error: Length " << token.length << " exceeds maximum expected length." << endl;
-                archive_corrupted = true;
-                file.close();
-                outFile.close();
-                return;
+        if(length <= config.maxInsert)
+            for(; nextInsert < pos + length && nextInsert + HASH_BYTES <= dataEnd; nextInsert++)
+                InsertPosition<HASH_BITS, HASH_BYTES, BINARY_TREE>(chain, config, nextInsert, windowStart, dataEnd);
+
+        pos += length;
+        nextInsert = pos;
+    }
+
+    lengthFreqMap[256]++;
+
+    file.close();
+}
+
+int LengthExtraBits(const int &symbol) {
+    if(symbol < 257)
+        return 0;
+
+    return LENGTH_BASES[symbol - 257].extraBits;
+}
+
+//the offset table starts with the number of codes, then every code with its length on 4 bits
+int OffsetCountBits(const int &codes) {
+    return BitsNeeded(codes);
+}
+
+int OffsetSymbolBits(const int &codes) {
+    return BitsNeeded(codes - 1);
+}
+
+int OffsetExtraBits(const int &symbol) {
+    return OFFSET_BASES[symbol].extraBits;
+}
+
+//the bits of every symbol, extra bits included; a symbol without a code is priced one bit above the longest code
+void ParseCosts(const vector<int> &codeLengths, int (*extraBits)(const int &), vector<int> &costs) {
+    int unseen = *max_element(codeLengths.begin(), codeLengths.end()) + 1;
+
+    for(size_t i = 0; i < codeLengths.size(); i++)
+        costs[i] = (codeLengths[i] ? codeLengths[i] : unseen) + extraBits(static_cast<int>(i));
+}
+
+//optimal parsing: the matches of a whole segment are collected first, then the cheapest path through the segment is found
+//with the bit costs of the tables the previous pass would get; the first segment starts from the fixed tables, the next ones
+//from the tables of the segment before
+template<int HASH_BITS, int HASH_BYTES, bool BINARY_TREE>
+void FindTokensOptimal(const FileChunk &chunk, HashChain &chain, TokenBuffer &tokens, const CompressionLevel &config, vector<uint64_t> &lengthFreqMap, vector<uint64_t> &offsetFreqMap) {
+    ifstream file(chunk.address, ios::binary);
+    if(!file.is_open()) {
+        cerr << "Error opening file: " << chunk.address << endl;
+        file.close();
+        archive_corrupted = true;
+        return;
+    }
+    file.seekg(static_cast<streamoff>(chunk.start - chunk.dictionary));
+
+    ResetHashChain(chain, HASH_BITS, archiveHeader.WindowSize(), BINARY_TREE);
+    ClearTokenBuffer(tokens);
+
+    //the same window as FindTokens, a segment and the lookahead of its last position fit in the half after pos
+    unsigned char *window = chain.window.data();
+    const uint64_t windowSize = chain.window.size();
+    const uint64_t chunkEnd = chunk.length == UINT64_MAX ? UINT64_MAX : chunk.dictionary + chunk.length;
+    const uint64_t segmentSize = min<uint64_t>(OPTIMAL_SEGMENT_SIZE, chain.windowSize - MIN_LOOKAHEAD);
+    uint64_t windowStart = 0, dataEnd = 0, pos = 0;
+    bool end_of_file = false;
+
+    const int codes = static_cast<int>(offsetFreqMap.size());
+    vector<int> lengthCodeLengths = FixedCodeLengths(286), offsetCodeLengths = FixedCodeLengths(codes);
+    vector<int> lengthCosts(286), offsetCosts(codes), matchCosts(LOOKAHEAD_SIZE + 1);
+
+    //the matches of position i are matches[matchStart[i]] to matches[matchStart[i + 1] - 1], each longer and farther than the one before
+    vector<uint32_t> matchStart;
+    vector<pair<uint16_t, uint32_t>> matches;
+    //the cheapest cost of the first i bytes and the token that ends there
+    vector<uint32_t> price, stepOffset;
+    vector<uint16_t> stepLength;
+    vector<LZ77> parse;
+
+    while(!archive_corrupted) {
+        while(!end_of_file && dataEnd - pos < segmentSize + MIN_LOOKAHEAD) {
+            if(dataEnd - windowStart == windowSize) {
+                uint64_t shift = pos - chain.windowSize - windowStart;
+                memmove(window, window + shift, dataEnd - windowStart - shift);
+                windowStart += shift;
             }
-        }
 
-        if(token.offset == 0) {
-            //do nothing
-        }
-        else if(token.offset <= 4)
-            offsetFreqMap[token.offset - 1]++;
-        else if(token.offset <= 8)
-            offsetFreqMap[4 + (token.offset - 5) / 2]++;
-        else if(token.offset <= 16)
-            offsetFreqMap[6 + (token.offset - 9) / 4]++;
-        else if(token.offset <= 32)
-            offsetFreqMap[8 + (token.offset - 17) / 8]++;
-        else if(token.offset <= 64)
-            offsetFreqMap[10 + (token.offset - 33) / 16]++;
-        else if(token.offset <= 128)
-            offsetFreqMap[12 + (token.offset - 65) / 32]++;
-        else if(token.offset <= 256)
-            offsetFreqMap[14 + (token.offset - 129) / 64]++;
-        else if(token.offset <= 512)
-            offsetFreqMap[16 + (token.offset - 257) / 128]++;
-        else if(token.offset <= 1024)
-            offsetFreqMap[18 + (token.offset - 513) / 256]++;
-        else if(token.offset <= 2048)
-            offsetFreqMap[20 + (token.offset - 1025) / 512]++;
-        else if(token.offset <= 4096)
-            offsetFreqMap[22 + (token.offset - 2049) / 1024]++;
-        else if(token.offset <= 8192)
-            offsetFreqMap[24 + (token.offset - 4097) / 2048]++;
-        else if(token.offset <= 16384)
-            offsetFreqMap[26 + (token.offset - 8193) / 4096]++;
-        else if(token.offset <= 32768)
-            offsetFreqMap[28 + (token.offset - 16385) / 8192]++;
-        else {
-            cerr << "Error: Offset " << token.offset << " exceeds maximum expected offset." << endl;
-            archive_corrupted = true;
-            file.close();
-            outFile.close();
-            return;
+            file.read(reinterpret_cast<char*>(window + (dataEnd - windowStart)), min(windowSize - (dataEnd - windowStart), chunkEnd - dataEnd));
+            dataEnd += static_cast<uint64_t>(file.gcount());
+
+            if(file.gcount() == 0 || dataEnd == chunkEnd)
+                end_of_file = true;
         }
 
-        for (int i = 0; i <= token.length - (token.length != 0); ++i) {       
-            search_buffer[search_buffer_pos % WINDOW_SIZE] = lookahead_buffer[lookahead_buffer_pos % LOOKAHEAD_SIZE];
+        if(pos == dataEnd)
+            break;
 
-            uint32_t h2 = Hash(search_buffer, (search_buffer_pos - MIN_MATCH) % WINDOW_SIZE);
-            hashTable[h2].push_back(search_buffer_pos - MIN_MATCH);
+        if(pos < chunk.dictionary) {
+            InsertPosition<HASH_BITS, HASH_BYTES, BINARY_TREE>(chain, config, pos, windowStart, dataEnd);
+            pos++;
 
-            while (!hashTable[h2].empty() && search_buffer_pos - MIN_MATCH - hashTable[h2].front() >= WINDOW_SIZE)
-                hashTable[h2].pop_front();
-            
-            search_buffer_pos++;
+            continue;
+        }
+
+        const uint64_t count = min(dataEnd, pos + segmentSize) - pos;
+        const unsigned char *data = window + (pos - windowStart);
+
+        //positions inside a match of at least niceLength are only added to the hash chain
+        matchStart.assign(count + 1, 0);
+        matches.clear();
+        uint64_t skipUntil = 0;
+        for(uint64_t i = 0; i < count; i++) {
+            matchStart[i] = static_cast<uint32_t>(matches.size());
 
-            if(bytesLengthIdx < bytesLength) {
-                lookahead_buffer[lookahead_buffer_pos % LOOKAHEAD_SIZE] = bytes[bytesLengthIdx];
-                bytesLengthIdx++;
+            if(i < skipUntil) {
+                InsertPosition<HASH_BITS, HASH_BYTES, BINARY_TREE>(chain, config, pos + i, windowStart, dataEnd);
+                continue;
             }
-            else {
-                ReadDataToCompress(bytes, bytesLength, bytesLengthIdx, file);
-                if(bytesLengthIdx < bytesLength) {
-                    lookahead_buffer[lookahead_buffer_pos % LOOKAHEAD_SIZE] = bytes[bytesLengthIdx];
-                    bytesLengthIdx++;
+
+            uint32_t offset = 0;
+            size_t found = matches.size();
+            FindMatch<HASH_BITS, HASH_BYTES, BINARY_TREE>(chain, config, pos + i, windowStart, dataEnd, MIN_MATCH - 1, config.maxChain, offset, &matches);
+            if(matches.size() > found && matches.back().first >= config.niceLength)
+                skipUntil = i + matches.back().first;
+        }
+        matchStart[count] = static_cast<uint32_t>(matches.size());
+
+        price.resize(count + 1);
+        stepOffset.resize(count + 1);
+        stepLength.resize(count + 1);
+
+        for(int pass = 0; pass < config.optimalPasses; pass++) {
+            ParseCosts(lengthCodeLengths, LengthExtraBits, lengthCosts);
+            ParseCosts(offsetCodeLengths, OffsetExtraBits, offsetCosts);
+            for(int length = MIN_MATCH; length <= LOOKAHEAD_SIZE; length++)
+                matchCosts[length] = lengthCosts[LengthSymbol({1, static_cast<uint16_t>(length), '-'})];
+
+            fill(price.begin() + 1, price.end(), UINT32_MAX);
+            price[0] = 0;
+
+            for(uint64_t i = 0; i < count; i++) {
+                uint32_t cost = price[i] + lengthCosts[data[i]];
+                if(cost < price[i + 1]) {
+                    price[i + 1] = cost;
+                    stepLength[i + 1] = 1;
+                    stepOffset[i + 1] = 0;
+                }
+
+                //every length up to the one of a match is priced with the closest match that reaches it, matches do not leave the segment
+                int shorter = MIN_MATCH - 1;
+                const int longest = static_cast<int>(min<uint64_t>(LOOKAHEAD_SIZE, count - i));
+                for(uint32_t m = matchStart[i]; m < matchStart[i + 1] && shorter < longest; m++) {
+                    const int length = min<int>(matches[m].first, longest);
+                    const uint32_t offset = matches[m].second;
+                    const uint32_t base = price[i] + offsetCosts[OffsetSymbol(offset)];
+
+                    for(int l = shorter + 1; l <= length; l++) {
+                        cost = base + matchCosts[l];
+                        if(cost < price[i + l]) {
+                            price[i + l] = cost;
+                            stepLength[i + l] = static_cast<uint16_t>(l);
+                            stepOffset[i + l] = offset;
+                        }
+                    }
+                    shorter = length;
                 }
             }
 
-            lookahead_buffer_pos++;
-            abs_pos++;
+            parse.clear();
+            for(uint64_t i = count; i > 0; i -= stepLength[i])
+                parse.push_back(stepOffset[i] ? LZ77{stepOffset[i], stepLength[i], '-'} : LZ77{0, 0, data[i - 1]});
+
+            //the next pass (or segment) prices the symbols with the tables of this parse
+            vector<uint64_t> lengthCounts(286, 0), offsetCounts(codes, 0);
+            for(const LZ77 &token : parse) {
+                lengthCounts[LengthSymbol(token)]++;
+                if(token.offset != 0)
+                    offsetCounts[OffsetSymbol(token.offset)]++;
+            }
+            lengthCounts[256]++;
+
+            lengthCodeLengths = HuffmanCodeLengths(lengthCounts, 286);
+            offsetCodeLengths = HuffmanCodeLengths(offsetCounts, codes);
         }
-    }
 
-    //mark the end of this file, token.length > token.offset, which is impossible
-    WriteToBuffer_2(outFile, 0);
-    WriteToBufferBig_2(outFile, 1, 9);
-    WriteToBufferBig_2(outFile, 0, 16);
+        for(auto token = parse.rbegin(); token != parse.rend(); ++token)
+            AddToken(tokens, *token, lengthFreqMap, offsetFreqMap);
 
-    if(byteIndex_2 > 0)
-        writeBuffer_2[writeBufferIndex_2] <<= (8 - byteIndex_2);
-    outFile.write(reinterpret_cast<char*>(writeBuffer_2), writeBufferIndex_2 + (byteIndex_2 > 0));
+        pos += count;
+    }
 
     lengthFreqMap[256]++;
 
     file.close();
-    outFile.close();
 }
 
-void WriteCodesToFile(const string &fileAddress, ofstream &outFile, const vector<pair<int, int>> &lengthCodes, const vector<pair<int, int>> &offsetCodes) {
-    uint64_t fileSize = 0, abs_pos = 0, search_buffer_pos = 0, lookahead_buffer_pos = 0;
+//the hash is fixed at compile time, so each group of levels gets its own copy of the match finder
+void GetLZ77Frequency(const FileChunk &chunk, HashChain &chain, TokenBuffer &tokens, const CompressionLevel &config, vector<uint64_t> &lengthFreqMap, vector<uint64_t> &offsetFreqMap) {
+    if(config.binaryTree && config.optimalPasses > 0 && config.hashBits == 17 && config.hashBytes == 3)
+        FindTokensOptimal<17, 3, true>(chunk, chain, tokens, config, lengthFreqMap, offsetFreqMap);
+    else if(config.binaryTree && config.optimalPasses == 0 && config.hashBits == 17 && config.hashBytes == 3)
+        FindTokens<17, 3, true>(chunk, chain, tokens, config, lengthFreqMap, offsetFreqMap);
+    else if(config.binaryTree || config.optimalPasses > 0) {
+        cerr << "Unsupported match finder: " << config.hashBits << " bits of " << config.hashBytes << " bytes" << endl;
+        archive_corrupted = true;
+    }
+    else if(config.hashBits == 15 && config.hashBytes == 4)
+        FindTokens<15, 4, false>(chunk, chain, tokens, config, lengthFreqMap, offsetFreqMap);
+    else if(config.hashBits == 16 && config.hashBytes == 3)
+        FindTokens<16, 3, false>(chunk, chain, tokens, config, lengthFreqMap, offsetFreqMap);
+    else if(config.hashBits == 17 && config.hashBytes == 3)
+        FindTokens<17, 3, false>(chunk, chain, tokens, config, lengthFreqMap, offsetFreqMap);
+    else {
+        cerr << "Unsupported hash: " << config.hashBits << " bits of " << config.hashBytes << " bytes" << endl;
+        archive_corrupted = true;
+    }
+}
+
+//how many bits the tokens with these frequencies take, end-of-block included
+uint64_t TokenBitLength(const vector<uint64_t> &lengthFreqMap, const vector<uint64_t> &offsetFreqMap, const vector<pair<int, int>> &lengthCodes, const vector<pair<int, int>> &offsetCodes) {
+    uint64_t bits = 0;
+
+    for(int i = 0; i < 286; i++)
+        if(lengthFreqMap[i] > 0)
+            bits += lengthFreqMap[i] * (lengthCodes[i].second + LengthExtraBits(i));
+
+    for(size_t i = 0; i < offsetFreqMap.size(); i++)
+        if(offsetFreqMap[i] > 0)
+            bits += offsetFreqMap[i] * (offsetCodes[i].second + OffsetExtraBits(static_cast<int>(i)));
+
+    return bits;
+}
+
+//how many bits WriteCodesToFile writes for these frequencies and codes
+uint64_t BlockBitLength(const vector<uint64_t> &lengthFreqMap, const vector<uint64_t> &offsetFreqMap, const vector<pair<int, int>> &lengthCodes, const vector<pair<int, int>> &offsetCodes) {
+    const int codes = static_cast<int>(offsetFreqMap.size());
+    uint64_t tableBits = 9 + 14 * static_cast<uint64_t>(lengthCodes.back().first) + OffsetCountBits(codes) + (OffsetSymbolBits(codes) + 4) * static_cast<uint64_t>(offsetCodes.back().first);
+
+    return tableBits + TokenBitLength(lengthFreqMap, offsetFreqMap, lengthCodes, offsetCodes);
+}
+
+//size of a dynamic block from the entropy of its symbols, without building the Huffman trees
+double EstimateBlockBits(const vector<uint64_t> &lengthFreqMap, const vector<uint64_t> &offsetFreqMap) {
+    const int codes = static_cast<int>(offsetFreqMap.size());
+    double bits = 9 + OffsetCountBits(codes);
+
+    uint64_t total = 1; //end-of-block
+    for(int i = 0; i < 286; i++)
+        total += lengthFreqMap[i];
+
+    for(int i = 0; i < 286; i++) {
+        uint64_t frequency = lengthFreqMap[i] + (i == 256);
+        if(frequency > 0)
+            bits += 14 + frequency * (log2(static_cast<double>(total) / frequency) + LengthExtraBits(i));
+    }
+
+    total = 0;
+    for(int i = 0; i < codes; i++)
+        total += offsetFreqMap[i];
+
+    for(int i = 0; i < codes; i++)
+        if(offsetFreqMap[i] > 0)
+            bits += OffsetSymbolBits(codes) + 4 + offsetFreqMap[i] * (log2(static_cast<double>(total) / offsetFreqMap[i]) + OffsetExtraBits(i));
+
+    return bits;
+}
+
+//builds the Huffman tables of a finished block and keeps the cheapest of the three block types
+BlockPlan FinishBlock(vector<uint64_t> lengthFreqMap, const vector<uint64_t> &offsetFreqMap, const uint64_t &tokens, const uint64_t &bytes) {
+    const int codes = static_cast<int>(offsetFreqMap.size());
+    BlockPlan block;
+    block.tokens = tokens;
+    block.bytes = bytes;
+
+    lengthFreqMap[256]++;
+
+    vector<int> codeLengths = HuffmanCodeLengths(lengthFreqMap, 286), codeLengthsOffset = HuffmanCodeLengths(offsetFreqMap, codes);
+
+    uint64_t dynamicBits = 3 + BlockBitLength(lengthFreqMap, offsetFreqMap, GenerateCanonicalHuffmanCodes(codeLengths, 286), GenerateCanonicalHuffmanCodes(codeLengthsOffset, codes));
+    uint64_t fixedBits = 3 + TokenBitLength(lengthFreqMap, offsetFreqMap, FixedCodes(286), FixedCodes(codes));
+    uint64_t storedBits = 3 + 32 + 8 * bytes;
+
+    if(storedBits < fixedBits && storedBits < dynamicBits) {
+        block.type = STORED_BLOCK;
+        block.bits = storedBits;
+    }
+    else if(fixedBits <= dynamicBits) {
+        block.type = FIXED_BLOCK;
+        block.bits = fixedBits;
+    }
+    else {
+        block.type = DYNAMIC_BLOCK;
+        block.bits = dynamicBits;
+        block.lengthCodeLengths = move(codeLengths);
+        block.offsetCodeLengths = move(codeLengthsOffset);
+    }
+
+    return block;
+}
+
+//splits the tokens of a chunk in blocks: a new block starts when the next segment of tokens would cost less with tables of its own
+vector<BlockPlan> PlanBlocks(TokenBuffer &tokens) {
+    vector<BlockPlan> blocks;
+    const int codes = archiveHeader.OffsetCodes();
+    vector<uint64_t> blockLengthFreq(286, 0), blockOffsetFreq(codes, 0), segmentLengthFreq(286, 0), segmentOffsetFreq(codes, 0);
+    uint64_t blockTokens = 0, blockBytes = 0, segmentTokens = 0, segmentBytes = 0;
+    int blockSegments = 0;
+
+    auto addSegment = [&]() {
+        if(blockTokens > 0) {
+            bool split = blockSegments == MAX_BLOCK_SEGMENTS;
+
+            if(!split) {
+                vector<uint64_t> mergedLengthFreq(286), mergedOffsetFreq(codes);
+                for(int i = 0; i < 286; i++)
+                    mergedLengthFreq[i] = blockLengthFreq[i] + segmentLengthFreq[i];
+                for(int i = 0; i < codes; i++)
+                    mergedOffsetFreq[i] = blockOffsetFreq[i] + segmentOffsetFreq[i];
+
+                split = EstimateBlockBits(blockLengthFreq, blockOffsetFreq) + EstimateBlockBits(segmentLengthFreq, segmentOffsetFreq) < EstimateBlockBits(mergedLengthFreq, mergedOffsetFreq);
+            }
+
+            if(split) {
+                blocks.push_back(FinishBlock(blockLengthFreq, blockOffsetFreq, blockTokens, blockBytes));
+
+                fill(blockLengthFreq.begin(), blockLengthFreq.end(), 0);
+                fill(blockOffsetFreq.begin(), blockOffsetFreq.end(), 0);
+                blockTokens = blockBytes = 0;
+                blockSegments = 0;
+            }
+        }
+
+        for(int i = 0; i < 286; i++)
+            blockLengthFreq[i] += segmentLengthFreq[i];
+        for(int i = 0; i < codes; i++)
+            blockOffsetFreq[i] += segmentOffsetFreq[i];
+        blockTokens += segmentTokens;
+        blockBytes += segmentBytes;
+        blockSegments++;
 
+        fill(segmentLengthFreq.begin(), segmentLengthFreq.end(), 0);
+        fill(segmentOffsetFreq.begin(), segmentOffsetFreq.end(), 0);
+        segmentTokens = segmentBytes = 0;
+    };
+
+    RewindTokenBuffer(tokens);
+    uint32_t packedToken;
+
+    while(NextToken(tokens, packedToken)) {
+        LZ77 token = UnpackToken(packedToken);
+
+        segmentLengthFreq[LengthSymbol(token)]++;
+        if(token.length > 0)
+            segmentOffsetFreq[OffsetSymbol(token.offset)]++;
+
+        segmentTokens++;
+        segmentBytes += token.length > 0 ? token.length : 1;
+
+        if(segmentTokens == BLOCK_SEGMENT_TOKENS)
+            addSegment();
+    }
+
+    if(segmentTokens > 0)
+        addSegment();
+
+    //an empty chunk still has one block, with just the end-of-block code
+    blocks.push_back(FinishBlock(blockLengthFreq, blockOffsetFreq, blockTokens, blockBytes));
+
+    return blocks;
+}
+
+void WriteHuffmanTables(BitWriter &writer, const vector<pair<int, int>> &lengthCodes, const vector<pair<int, int>> &offsetCodes) {
 //-------------------------------------------------LENGTH CODES-----------------------------------------------------------------
 
     int codesSize = static_cast<int>(lengthCodes[lengthCodes.size() - 1].first);
@@ -436,14 +915,14 @@ void WriteCodesToFile(const string &fileAddress, ofstream &outFile, const vector
         return;
     }
 
-    WriteToBufferBig(outFile, codesSize, 9);
+    writer.Put(codesSize, 9);
 
     for(int i = 0; i < 286; i++) {
         if(lengthCodes[i].second == -1) {
             continue;
         }
         
-        WriteToBufferBig(outFile, i, 9);
+        writer.Put(i, 9);
 
         if(lengthCodes[i].second > 31) {
             cerr << "Error: Code length exceeds 5 bits for code " << lengthCodes[i].second << " with symbol " << i << endl;
@@ -451,25 +930,26 @@ void WriteCodesToFile(const string &fileAddress, ofstream &outFile, const vector
             return;
         }
         
-        WriteToBuffer(outFile, lengthCodes[i].second, 5);
+        writer.Put(lengthCodes[i].second, 5);
     }
 
 //-------------------------------------------------OFFSET CODES-----------------------------------------------------------------
 
-    codesSize = static_cast<int>(offsetCodes[offsetCodes.size() - 1].first);
-    if(codesSize >= 32) {
-        cerr << "Error: Number of codes exceeds 32, cannot write to file:" << codesSize << endl;
+    const int codes = static_cast<int>(offsetCodes.size()) - 1;
+    codesSize = static_cast<int>(offsetCodes[codes].first);
+    if(codesSize > codes) {
+        cerr << "Error: Number of codes exceeds " << codes << ", cannot write to file:" << codesSize << endl;
         archive_corrupted = true;
         return;
     }
 
-    WriteToBuffer(outFile, codesSize, 5);
+    writer.Put(codesSize, OffsetCountBits(codes));
 
-    for(int i = 0; i < 30; i++) {
+    for(int i = 0; i < codes; i++) {
         if(offsetCodes[i].second == -1)
             continue;
         
-        WriteToBuffer(outFile, i, 5);
+        writer.Put(i, OffsetSymbolBits(codes));
 
         if(offsetCodes[i].second >= 16) {
             cerr << "Error: Code length exceeds 4 bits for offset " << i << " with length " << offsetCodes[i].second << endl;
@@ -477,202 +957,444 @@ void WriteCodesToFile(const string &fileAddress, ofstream &outFile, const vector
             return;
         }
         
-        WriteToBuffer(outFile, offsetCodes[i].second, 4);
+        writer.Put(offsetCodes[i].second, 4);
     }
+}
 
-//-------------------------------------------------TOKENS-----------------------------------------------------------------
+//writes the next count tokens and the end-of-block code
+void WriteTokens(BitWriter &writer, TokenBuffer &tokens, uint64_t count, const vector<pair<int, int>> &lengthCodes, const vector<pair<int, int>> &offsetCodes) {
+    uint32_t packedToken;
 
-    unsigned char buffer[READ_BUFFER_SIZE];
-    int bufferIdx = 0, bufferByteIdx = 0;
-    ifstream inputFile(tempFileName, ios::binary);
-    if(!inputFile) {
-        archive_corrupted = true;
+    while(count-- > 0 && NextToken(tokens, packedToken)) {
+        LZ77 token = UnpackToken(packedToken);
+
+        //--------------------------- LENGTH -----------------------------------
+
+        if(token.length == 0 && token.offset == 0)
+            writer.Put(lengthCodes[token.character].first, lengthCodes[token.character].second);
+        else {
+            const LengthCode &code = LENGTH_CODES[token.length];
+            writer.Put(lengthCodes[code.symbol].first, lengthCodes[code.symbol].second);
+            if(code.extraBits > 0)
+                writer.Put(code.extraValue, code.extraBits); // extra bits
+        }
+
+        //--------------------------- OFFSET -----------------------------------
+
+        if(token.offset == 0)
+            continue;
+
+        int symbol = OffsetSymbol(token.offset);
+        const CodeBase &offsetCode = OFFSET_BASES[symbol];
+        writer.Put(offsetCodes[symbol].first, offsetCodes[symbol].second);
+        if(offsetCode.extraBits > 0)
+            writer.Put(token.offset - offsetCode.base, offsetCode.extraBits); // extra bits
+    }
+
+    writer.Put(lengthCodes[256].first, lengthCodes[256].second); // end-of-block
+}
+
+void WriteCodesToFile(const string &fileAddress, BitWriter &writer, TokenBuffer &tokens, const vector<pair<int, int>> &lengthCodes, const vector<pair<int, int>> &offsetCodes) {
+    WriteHuffmanTables(writer, lengthCodes, offsetCodes);
+    if(archive_corrupted)
+        return;
+
+    RewindTokenBuffer(tokens);
+    WriteTokens(writer, tokens, UINT64_MAX, lengthCodes, offsetCodes);
+}
+
+void WriteBlocks(const FileChunk &chunk, BitWriter &writer, TokenBuffer &tokens, const vector<BlockPlan> &blocks) {
+    const int offsetCodeCount = archiveHeader.OffsetCodes();
+    ifstream file;
+    uint64_t position = chunk.start;
+
+    RewindTokenBuffer(tokens);
+
+    for(size_t i = 0; i < blocks.size() && !archive_corrupted; i++) {
+        const BlockPlan &block = blocks[i];
+
+        writer.Put(i + 1 == blocks.size(), 1);
+        writer.Put(block.type, 2);
+
+        if(block.type == STORED_BLOCK) {
+            //the raw bytes are read again from the file, the tokens are skipped
+            if(!file.is_open())
+                file.open(chunk.address, ios::binary);
+            file.seekg(static_cast<streamoff>(position));
+
+            writer.Put(block.bytes, 32);
+
+            unsigned char bytes[READ_BUFFER_SIZE];
+            for(uint64_t left = block.bytes; left > 0;) {
+                file.read(reinterpret_cast<char*>(bytes), min<uint64_t>(left, READ_BUFFER_SIZE));
+                if(file.gcount() <= 0) {
+                    cerr << "Error reading file: " << chunk.address << endl;
+                    archive_corrupted = true;
+                    return;
+                }
+
+                writer.PutBytes(bytes, static_cast<size_t>(file.gcount()));
+                left -= static_cast<uint64_t>(file.gcount());
+            }
+
+            uint32_t packedToken;
+            for(uint64_t j = 0; j < block.tokens; j++)
+                NextToken(tokens, packedToken);
+        }
+        else if(block.type == FIXED_BLOCK)
+            WriteTokens(writer, tokens, block.tokens, FixedCodes(286), FixedCodes(offsetCodeCount));
+        else {
+            vector<pair<int, int>> codes = GenerateCanonicalHuffmanCodes(block.lengthCodeLengths, 286);
+            vector<pair<int, int>> codesOffset = GenerateCanonicalHuffmanCodes(block.offsetCodeLengths, offsetCodeCount);
+
+            WriteHuffmanTables(writer, codes, codesOffset);
+            WriteTokens(writer, tokens, block.tokens, codes, codesOffset);
+        }
+
+        position += block.bytes;
+    }
+}
+
+void CompressFileName(string fileAddress, BitWriter &writer, int is_file = -1) {
+    string fileName = "";
+    for(auto i = fileAddress.rbegin(); i != fileAddress.rend() && *i != '/' && *i != '\\'; i++)
+        fileName += *i;
+    reverse(fileName.begin(), fileName.end());
+
+    char len = static_cast<char>(fileName.length());
+    writer.Put(len, 8);
+
+    for(int i = 0; i < len; i++) {
+        writer.Put(fileName[i], 8);
+    }
+
+    if(is_file != -1) {
+        if(is_file)
+            writer.Put(1, 1);
+        else
+            writer.Put(0, 1);
+        
         return;
     }
-    
-    inputFile.read(reinterpret_cast<char*>(buffer), READ_BUFFER_SIZE);
-    int bufferSize = static_cast<int>(inputFile.gcount());
 
-    while(bufferSize > 0) {
-        LZ77 token = ReadTokenFromBuffer(buffer, bufferIdx, bufferByteIdx, bufferSize, inputFile);
+    if(is_directory(fileAddress)) {
+        writer.Put(0, 1);
+    }
+    else
+        writer.Put(1, 1);
+}
 
-        //this mark the end of this file
-        if(token.length > token.offset)
-            break;
+void AddProgress(const float &amount) {
+    lock_guard<mutex> lock(progress_mutex);
+    *progress += amount;
+}
 
-        //--------------------------- LENGTH -----------------------------------
+uint64_t ChunkSize(const FileChunk &chunk) {
+    if(chunk.length != UINT64_MAX)
+        return chunk.length;
+
+    error_code error;
+    uint64_t size = filesystem::file_size(chunk.address, error);
+
+    return error || size < chunk.start ? 0 : size - chunk.start;
+}
+
+//samples the chunk: data with almost 8 bits of entropy per byte and almost no repeated sequences will not get smaller
+bool IsIncompressible(const FileChunk &chunk) {
+    uint64_t size = ChunkSize(chunk);
+    uint64_t samples = min<uint64_t>(PROBE_SAMPLES, size / PROBE_SAMPLE_SIZE);
+    if(samples == 0)
+        return false;
+
+    ifstream file(chunk.address, ios::binary);
+    if(!file.is_open())
+        return false;
+
+    vector<uint64_t> byteFreq(256, 0);
+    vector<int> head(size_t(1) << PROBE_HASH_BITS);
+    unsigned char sample[PROBE_SAMPLE_SIZE];
+    uint64_t positions = 0, matches = 0;
+
+    for(uint64_t i = 0; i < samples; i++) {
+        file.seekg(static_cast<streamoff>(chunk.start + i * (size / samples)));
+        file.read(reinterpret_cast<char*>(sample), PROBE_SAMPLE_SIZE);
+        if(file.gcount() != PROBE_SAMPLE_SIZE)
+            return false;
+
+        fill(head.begin(), head.end(), -1);
+
+        for(int j = 0; j < PROBE_SAMPLE_SIZE; j++)
+            byteFreq[sample[j]]++;
+
+        for(int j = 0; j + MIN_MATCH < PROBE_SAMPLE_SIZE; j++) {
+            uint32_t h = Hash<PROBE_HASH_BITS, MIN_MATCH + 1>(sample + j);
+
+            if(head[h] >= 0 && memcmp(sample + head[h], sample + j, MIN_MATCH + 1) == 0)
+                matches++;
+            head[h] = j;
+            positions++;
+        }
+    }
+
+    double entropy = 0;
+    const double total = static_cast<double>(samples * PROBE_SAMPLE_SIZE);
+    for(int i = 0; i < 256; i++)
+        if(byteFreq[i] > 0)
+            entropy -= byteFreq[i] / total * log2(byteFreq[i] / total);
+
+    return entropy >= STORED_MIN_ENTROPY && static_cast<double>(matches) / positions <= STORED_MAX_MATCH_RATE;
+}
+
+//writes the whole chunk as stored blocks, without looking for matches
+void WriteStoredChunk(const FileChunk &chunk, BitWriter &writer, TokenBuffer &tokens) {
+    vector<BlockPlan> blocks;
+    uint64_t size = ChunkSize(chunk), bits = 0;
+
+    do {
+        uint64_t bytes = min(size, MAX_STORED_BLOCK);
+        blocks.push_back({0, bytes, STORED_BLOCK, 3 + 32 + 8 * bytes, {}, {}});
+
+        bits += blocks.back().bits;
+        size -= bytes;
+    } while(size > 0);
+
+    ClearTokenBuffer(tokens);
+
+    writer.Put(chunk.final, 1);
+    writer.Put(bits, CHUNK_LENGTH_BITS);
+    WriteBlocks(chunk, writer, tokens, blocks);
+}
+
+void Compress_help(const FileChunk &chunk, BitWriter &writer, HashChain &chain, TokenBuffer &tokens, const CompressionLevel &config) {
+    if(archive_corrupted)
+        return;
+
+    const float ratio = progress_ratio * chunk.share;
+
+    if(archiveHeader.version >= BLOCK_TYPES_VERSION && IsIncompressible(chunk)) {
+        WriteStoredChunk(chunk, writer, tokens);
+        AddProgress(ratio);
+
+        return;
+    }
+
+    vector<uint64_t> lengthFreqMap(286, 0), offsetFreqMap(archiveHeader.OffsetCodes(), 0);
+
+    GetLZ77Frequency(chunk, chain, tokens, config, lengthFreqMap, offsetFreqMap);
+
+    if(archive_corrupted)
+        return;
+
+    AddProgress(0.5f * ratio);
+
+    if(archiveHeader.version >= BLOCK_TYPES_VERSION) {
+        vector<BlockPlan> blocks = PlanBlocks(tokens);
+
+        AddProgress(0.2f * ratio);
+
+        uint64_t bits = 0;
+        for(const auto &i : blocks)
+            bits += i.bits;
+
+        writer.Put(chunk.final, 1);
+        writer.Put(bits, CHUNK_LENGTH_BITS);
+        WriteBlocks(chunk, writer, tokens, blocks);
+
+        AddProgress(0.3f * ratio);
+
+        return;
+    }
+
+    vector<int> codeLengths = HuffmanCodeLengths(lengthFreqMap, 286);
+
+    AddProgress(0.1f * ratio);
+
+    vector<pair<int, int>> codes = GenerateCanonicalHuffmanCodes(codeLengths, 286);
+
+    vector<pair<int, int>> codesOffset;
+    if(!offsetFreqMap.empty())
+        codesOffset = GenerateCanonicalHuffmanCodes(HuffmanCodeLengths(offsetFreqMap, archiveHeader.OffsetCodes()), archiveHeader.OffsetCodes());
+
+    AddProgress(0.1f * ratio);
+
+    if(archiveHeader.version > 0) {
+        writer.Put(chunk.final, 1);
+        writer.Put(BlockBitLength(lengthFreqMap, offsetFreqMap, codes, codesOffset), CHUNK_LENGTH_BITS);
+    }
+
+    WriteCodesToFile(chunk.address, writer, tokens, codes, codesOffset);
+
+    AddProgress(0.3f * ratio);
+}
+
+vector<FileChunk> SplitInChunks(const vector<string> &addresses) {
+    vector<FileChunk> chunks;
+
+    for(const auto &i : addresses) {
+        if(is_directory(i))
+            continue;
 
-        if(token.length == 0 && token.offset == 0) {
-            WriteToBufferBig(outFile, lengthCodes[token.character].first, lengthCodes[token.character].second);
-        }
-        else if(token.length <= 10) {
-            WriteToBufferBig(outFile, lengthCodes[257 + token.length - 3].first, lengthCodes[257 + token.length - 3].second);
-        }
-        else if(token.length <= 18) {
-            WriteToBufferBig(outFile, lengthCodes[265 + (token.length - 11) / 2].first, lengthCodes[265 + (token.length - 11) / 2].second);
-            WriteToBuffer(outFile, !(token.length % 2), 1); // 1 extra bit
-        }
-        else if(token.length <= 34) {
-            WriteToBufferBig(outFile, lengthCodes[269 + (token.length - 19) / 4].first, lengthCodes[269 + (token.length - 19) / 4].second);
-            WriteToBuffer(outFile, (token.length - 19) % 4, 2); // 2 extra biti
-        }
-        else if(token.length <= 66) {
-            WriteToBufferBig(outFile, lengthCodes[273 + (token.length - 35) / 8].first, lengthCodes[273 + (token.length - 35) / 8].second);
-            WriteToBuffer(outFile, (token.length - 35) % 8, 3); // 3 extra biti
-        }
-        else if(token.length <= 130) {
-            WriteToBufferBig(outFile, lengthCodes[277 + (token.length - 67) / 16].first, lengthCodes[277 + (token.length - 67) / 16].second);
-            WriteToBuffer(outFile, (token.length - 67) % 16, 4); // 4 extra biti
+        if(archiveHeader.version == 0 || archiveHeader.chunkSize == 0) {
+            chunks.push_back({i, 0, UINT64_MAX, 0, true, 1.0f});
+            continue;
         }
-        else if(token.length <= 257) {
-            WriteToBufferBig(outFile, lengthCodes[281 + (token.length - 131) / 32].first, lengthCodes[281 + (token.length - 131) / 32].second);
-            WriteToBuffer(outFile, (token.length - 131) % 32, 5); // 5 extra biti
+
+        error_code error;
+        uint64_t size = filesystem::file_size(i, error);
+        if(error || size <= archiveHeader.chunkSize) {
+            chunks.push_back({i, 0, UINT64_MAX, 0, true, 1.0f});
+            continue;
         }
-        else if(token.length == 258)
-            WriteToBufferBig(outFile, lengthCodes[285].first, lengthCodes[285].second); //0 extra biti
-        else
-            WriteToBufferBig(outFile, lengthCodes[256].first, lengthCodes[256].second);
 
+        for(uint64_t start = 0; start < size; start += archiveHeader.chunkSize) {
+            uint64_t length = min<uint64_t>(archiveHeader.chunkSize, size - start);
+            //a primed chunk loads at most one chunk before it, a whole large window would cost more than the chunk itself
+            uint64_t dictionary = archiveHeader.primedChunks ? min<uint64_t>({start, archiveHeader.WindowSize(), archiveHeader.chunkSize}) : 0;
 
-        //--------------------------- OFFSET -----------------------------------
+            //the last chunk reads to the end of the file
+            if(start + length == size)
+                length = UINT64_MAX;
 
-        if(token.offset == 0) {
-            //do nothing
-        }
-        else if(token.offset <= 4) {
-            WriteToBufferBig(outFile, offsetCodes[token.offset - 1].first, offsetCodes[token.offset - 1].second);
-        }
-        else if(token.offset <= 8) {
-            WriteToBufferBig(outFile, offsetCodes[4 + (token.offset - 5) / 2].first, offsetCodes[4 + (token.offset - 5) / 2].second);
-            WriteToBuffer(outFile, !(token.offset % 2), 1); // 1 extra bit 
-        }
-        else if(token.offset <= 16) {
-            WriteToBufferBig(outFile, offsetCodes[6 + (token.offset - 9) / 4].first, offsetCodes[6 + (token.offset - 9) / 4].second);
-            WriteToBuffer(outFile, (token.offset - 9) % 4, 2); // 2 extra biti
-        }
-        else if(token.offset <= 32) {
-            WriteToBufferBig(outFile, offsetCodes[8 + (token.offset - 17) / 8].first, offsetCodes[8 + (token.offset - 17) / 8].second);
-            WriteToBuffer(outFile, (token.offset - 17) % 8, 3); // 3 extra biti
-        }
-        else if(token.offset <= 64) {
-            WriteToBufferBig(outFile, offsetCodes[10 + (token.offset - 33) / 16].first, offsetCodes[10 + (token.offset - 33) / 16].second);
-            WriteToBuffer(outFile, (token.offset - 33) % 16, 4); // 4 extra biti
-        }
-        else if(token.offset <= 128) {
-            WriteToBufferBig(outFile, offsetCodes[12 + (token.offset - 65) / 32].first, offsetCodes[12 + (token.offset - 65) / 32].second);
-            WriteToBuffer(outFile, (token.offset - 65) % 32, 5); // 5 extra biti
-        }
-        else if(token.offset <= 256) {
-            WriteToBufferBig(outFile, offsetCodes[14 + (token.offset - 129) / 64].first, offsetCodes[14 + (token.offset - 129) / 64].second);
-            WriteToBuffer(outFile, (token.offset - 129) % 64, 6); // 6 extra biti
-        }
-        else if(token.offset <= 512) {
-            WriteToBufferBig(outFile, offsetCodes[16 + (token.offset - 257) / 128].first, offsetCodes[16 + (token.offset - 257) / 128].second);
-            WriteToBuffer(outFile, (token.offset - 257) % 128, 7); // 7 extra biti
-        }
-        else if(token.offset <= 1024) {
-            WriteToBufferBig(outFile, offsetCodes[18 + (token.offset - 513) / 256].first, offsetCodes[18 + (token.offset - 513) / 256].second);
-            WriteToBuffer(outFile, (token.offset - 513) % 256); // 8 extra biti
-        }
-        else if(token.offset <= 2048) {
-            WriteToBufferBig(outFile, offsetCodes[20 + (token.offset - 1025) / 512].first, offsetCodes[20 + (token.offset - 1025) / 512].second);
-            WriteToBufferBig(outFile, (token.offset - 1025) % 512, 9); // 9 extra biti
-        }
-        else if(token.offset <= 4096) {
-            WriteToBufferBig(outFile, offsetCodes[22 + (token.offset - 2049) / 1024].first, offsetCodes[22 + (token.offset - 2049) / 1024].second);
-            WriteToBufferBig(outFile, (token.offset - 2049) % 1024, 10); // 10 extra biti
-        }
-        else if(token.offset <= 8192) {
-            WriteToBufferBig(outFile, offsetCodes[24 + (token.offset - 4097) / 2048].first, offsetCodes[24 + (token.offset - 4097) / 2048].second);
-            WriteToBufferBig(outFile, (token.offset - 4097) % 2048, 11); // 11 extra biti
-        }
-        else if(token.offset <= 16384) {
-            WriteToBufferBig(outFile, offsetCodes[26 + (token.offset - 8193) / 4096].first, offsetCodes[26 + (token.offset - 8193) / 4096].second);
-            WriteToBufferBig(outFile, (token.offset - 8193) % 4096, 12); // 12 extra biti
-        }
-        else {
-            WriteToBufferBig(outFile, offsetCodes[28 + (token.offset - 16385) / 8192].first, offsetCodes[28 + (token.offset - 16385) / 8192].second);
-            WriteToBufferBig(outFile, (token.offset - 16385) % 8192, 13); // 13 extra biti
+            chunks.push_back({i, start, length, dictionary, length == UINT64_MAX, static_cast<float>(min<uint64_t>(archiveHeader.chunkSize, size - start)) / size});
         }
     }
 
-    WriteToBufferBig(outFile, lengthCodes[256].first, lengthCodes[256].second); // end-of-block
-
-    inputFile.close();
+    return chunks;
 }
 
-void CompressFileName(string fileAddress, ofstream &outFile, int is_file = -1) {
-    string fileName = "";
-    for(auto i = fileAddress.rbegin(); i != fileAddress.rend() && *i != '/' && *i != '\\'; i++)
-        fileName += *i;
-    reverse(fileName.begin(), fileName.end());
+//the CRC-32 of the bytes of the chunk, read once more from the file; returns how many there are
+uint64_t ChunkChecksum(const FileChunk &chunk, uint32_t &checksum) {
+    checksum = 0;
 
-    char len = static_cast<char>(fileName.length());
-    WriteToBuffer(outFile, len);
+    ifstream file(chunk.address, ios::binary);
+    if(!file.is_open())
+        return 0;
+    file.seekg(static_cast<streamoff>(chunk.start));
 
-    for(int i = 0; i < len; i++) {
-        WriteToBuffer(outFile, fileName[i]);
-    }
+    vector<unsigned char> bytes(CHECKSUM_BUFFER_SIZE);
+    uint64_t size = 0, left = chunk.length;
 
-    if(is_file != -1) {
-        if(is_file)
-            WriteToBuffer(outFile, 1, 1);
-        else
-            WriteToBuffer(outFile, 0, 1);
-        
-        return;
-    }
+    while(left > 0) {
+        file.read(reinterpret_cast<char*>(bytes.data()), static_cast<streamsize>(min<uint64_t>(left, bytes.size())));
+        const uint64_t count = static_cast<uint64_t>(file.gcount());
+        if(count == 0)
+            break;
 
-    if(is_directory(fileAddress)) {
-        WriteToBuffer(outFile, 0, 1);
+        checksum = Crc32(checksum, bytes.data(), count);
+        size += count;
+        if(left != UINT64_MAX)
+            left -= count;
     }
-    else
-        WriteToBuffer(outFile, 1, 1);
+
+    return size;
 }
 
-void Compress_help(const string &address, ofstream &outFile) {
-    if(archive_corrupted)
-        return;
-    
-    float save = *progress;
+//the first chunk of a file starts its directory entry, the others add their bits, bytes and checksum to it
+void AddToDirectory(vector<DirectoryEntry> &entries, const FileChunk &chunk, const uint64_t &start, const uint64_t &end, const uint64_t &size, const uint32_t &checksum) {
+    if(chunk.start == 0)
+        entries.push_back({start, 0, 0, 0});
 
-    vector<uint64_t> lengthFreqMap(286, 0), offsetFreqMap(30, 0);
+    DirectoryEntry &entry = entries.back();
+    entry.bits = end - entry.offset;
+    entry.checksum = Crc32Combine(entry.checksum, checksum, size);
+    entry.size += size;
+}
 
-    GetLZ77Frequency(address, lengthFreqMap, offsetFreqMap);
+//compresses the files after what writer has, entries gets the stream of each one when the archive has a directory
+//and every stream then starts at a byte, so that it can be copied as it is
+void CompressFiles(const vector<string> &addresses, BitWriter &writer, const CompressionLevel &config, vector<DirectoryEntry> &entries) {
+    vector<FileChunk> chunks = SplitInChunks(addresses);
+    const bool directory = archiveHeader.version >= DIRECTORY_VERSION;
+
+    size_t threadCount = min<size_t>(max(thread::hardware_concurrency(), 1u), chunks.size());
+
+    if(threadCount <= 1) {
+        HashChain chain;
+        TokenBuffer tokens;
+        for(const auto &i : chunks) {
+            if(directory && i.start == 0)
+                writer.Align();
+
+            const uint64_t start = writer.Position();
+            Compress_help(i, writer, chain, tokens, config);
+
+            if(directory) {
+                uint32_t checksum;
+                uint64_t size = ChunkChecksum(i, checksum);
+                AddToDirectory(entries, i, start, writer.Position(), size, checksum);
+            }
+        }
 
-    if(archive_corrupted)
         return;
+    }
 
-    *progress += 0.5f * progress_ratio;
+    //every worker compresses whole chunks into its own bit stream, the streams are written in the original order
+    vector<CompressedStream> streams(chunks.size());
+    size_t nextChunk = 0, nextStream = 0;
+    mutex streamsMutex;
+    condition_variable streamDone, streamWritten;
 
-    HuffmanNode* rootLength = BuildHuffmanTree(lengthFreqMap, 286);
+    auto worker = [&]() {
+        HashChain chain;
+        TokenBuffer tokens;
 
-    HuffmanNode* rootOffset = nullptr;
-    if(!offsetFreqMap.empty())
-        rootOffset = BuildHuffmanTree(offsetFreqMap, 30);
+        while(true) {
+            size_t idx;
+            {
+                unique_lock<mutex> lock(streamsMutex);
+                streamWritten.wait(lock, [&] { return nextChunk == chunks.size() || nextChunk < nextStream + threadCount * PENDING_STREAMS_PER_THREAD; });
+                if(nextChunk == chunks.size())
+                    return;
+                idx = nextChunk++;
+            }
 
-    *progress += 0.1f * progress_ratio;
+            ostringstream chunkStream;
+            BitWriter chunkWriter(chunkStream);
+            Compress_help(chunks[idx], chunkWriter, chain, tokens, config);
 
-    vector<int> codeLengths(286);
-    ExtractCodeLengths(rootLength, 0, codeLengths);
-    vector<pair<int, int>> codes = GenerateCanonicalHuffmanCodes(codeLengths, 286);
+            CompressedStream stream = TakeStream(chunkWriter, chunkStream);
+            if(directory)
+                stream.size = ChunkChecksum(chunks[idx], stream.checksum);
 
-    vector<pair<int, int>> codesOffset;
-    if(!offsetFreqMap.empty()) {
-        vector<int> codeLengthsOffset(30);
-        ExtractCodeLengths(rootOffset, 0, codeLengthsOffset);
-        codesOffset = GenerateCanonicalHuffmanCodes(codeLengthsOffset, 30);
-    }
+            {
+                lock_guard<mutex> lock(streamsMutex);
+                streams[idx] = move(stream);
+                streams[idx].done = true;
+            }
+            streamDone.notify_all();
+        }
+    };
 
-    *progress += 0.1f * progress_ratio;
+    vector<thread> workers;
+    for(size_t i = 0; i < threadCount; i++)
+        workers.emplace_back(worker);
 
-    WriteCodesToFile(address, outFile, codes, codesOffset);
+    for(size_t i = 0; i < chunks.size(); i++) {
+        CompressedStream stream;
+        {
+            unique_lock<mutex> lock(streamsMutex);
+            streamDone.wait(lock, [&] { return streams[i].done; });
+            stream = move(streams[i]);
+            nextStream = i + 1;
+        }
+        streamWritten.notify_all();
+
+        if(directory && chunks[i].start == 0)
+            writer.Align();
+
+        const uint64_t start = writer.Position();
+        WriteStreamToBuffer(writer, stream);
+
+        if(directory)
+            AddToDirectory(entries, chunks[i], start, writer.Position(), stream.size, stream.checksum);
+    }
 
-    *progress = save + progress_ratio;
+    for(auto &i : workers)
+        i.join();
 }
 
-void CompressNames(const string &folderPath, ofstream &outFile, vector<string> &addresses) {
-    CompressFileName(folderPath, outFile);
+void CompressNames(const string &folderPath, BitWriter &writer, vector<string> &addresses) {
+    CompressFileName(folderPath, writer);
     addresses.push_back(folderPath);
 
     if(!is_directory(folderPath)) {
@@ -697,50 +1419,53 @@ void CompressNames(const string &folderPath, ofstream &outFile, vector<string> &
             continue;
         
         if (findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-            CompressNames(folderPath + "/" + findFileData.cFileName, outFile, addresses);
+            CompressNames(folderPath + "/" + findFileData.cFileName, writer, addresses);
 
             continue;
         }
 
         string filePath = string(path) + "/" + findFileData.cFileName;
 
-        CompressFileName(filePath, outFile);
+        CompressFileName(filePath, writer);
         addresses.push_back(filePath);
 
     } while (FindNextFileA(hFind, &findFileData) != 0);
 
     FindClose(hFind);
 
-    WriteToBuffer(outFile, 0);
+    writer.Put(0, 8);
 }
 
-void Compress(const vector<string> &filesToCompressAddress, const string &compressedFileAddress, float &prog) {
+void Compress(const vector<string> &filesToCompressAddress, const string &compressedFileAddress, float &prog, int level, unsigned int chunkSize, bool primedChunks, unsigned int windowSize) {
     archive_corrupted = false;
 
     prog = 0;
     progress = &prog;
 
-    writeBufferIndex = 0;
-    byteIndex = 0;
-    int fileNumber = 0;
-    while(fileNumber < INT_MAX && FileExists(filesystem::temp_directory_path().string() + "tempFile_" + to_string(fileNumber) + ".txt"))
-        fileNumber++;
-    tempFileName = filesystem::temp_directory_path().string() + "tempFile_" + to_string(fileNumber) + ".txt";
-
     ofstream outFile(compressedFileAddress, ios::binary);
     if(!outFile) {
         archive_corrupted = true;
-        remove(tempFileName.c_str());
         return;
     }
+    BitWriter writer(outFile);
+
+    archiveHeader.version = ARCHIVE_VERSION;
+    archiveHeader.chunkSize = chunkSize == 0 ? 0 : clamp(chunkSize, MIN_CHUNK_SIZE, MAX_CHUNK_SIZE);
+    archiveHeader.primedChunks = primedChunks;
+    archiveHeader.windowLog = BitsNeeded(clamp(windowSize, DEFAULT_WINDOW_SIZE, MAX_WINDOW_SIZE) - 1);
+    WriteArchiveHeader(writer, archiveHeader);
+
+    //the names go in the directory, after the files
+    ostringstream namesStream;
+    BitWriter namesWriter(namesStream);
 
     vector<string> addresses;
     for(const auto &i : filesToCompressAddress) {
-        CompressNames(i, outFile, addresses);
+        CompressNames(i, namesWriter, addresses);
 
         *progress += 0.2f / static_cast<float>(filesToCompressAddress.size());
     }
-    WriteToBuffer(outFile, 0);
+    namesWriter.Put(0, 8);
 
     *progress = 0.2f;
     progress_ratio = 0;
@@ -749,17 +1474,16 @@ void Compress(const vector<string> &filesToCompressAddress, const string &compre
             progress_ratio += 1;
 
     progress_ratio = 0.8f / progress_ratio;
-    
-    for(const auto &i : addresses)
-        if(!is_directory(i))
-            Compress_help(i, outFile);
+
+    const CompressionLevel &config = COMPRESSION_LEVELS[clamp(level, MIN_COMPRESSION_LEVEL, MAX_COMPRESSION_LEVEL)];
+    vector<DirectoryEntry> entries;
+    CompressFiles(addresses, writer, config, entries);
+
+    WriteDirectory(writer, TakeStream(namesWriter, namesStream), entries);
 
     //Write what is left
-    if(byteIndex > 0)
-        writeBuffer[writeBufferIndex] <<= (8 - byteIndex);
-    outFile.write(reinterpret_cast<char*>(writeBuffer), writeBufferIndex + (byteIndex > 0));
+    writer.Finish();
 
-    remove(tempFileName.c_str());
     outFile.close();
 
     *progress = 1;
@@ -770,357 +1494,468 @@ void Compress(const vector<string> &filesToCompressAddress, const string &compre
 
 //---------------------------------------------------- DECOMPRESSING ALGORITHM --------------------------------------------------
 
-void ReverseCode(const vector<pair<int, int>> &sorted, unordered_map<string, int> &codes) {
-    int code = 0;
-    int prev_len = 0;
+//builds the decoding table of a canonical code from its {length, symbol} pairs sorted by length, then symbol
+//returns false when there are more codes than the lengths allow
+bool BuildHuffmanDecoder(const vector<pair<int, int>> &sorted, HuffmanDecoder &decoder) {
+    decoder.table.assign(1 << HUFFMAN_TABLE_BITS, 0);
+
+    //the canonical codes, and for the first bits of the longer ones how many bits their second level table needs
+    vector<uint32_t> codes(sorted.size());
+    vector<int> subtableBits(1 << HUFFMAN_TABLE_BITS, 0);
+    uint64_t code = 0;
+    int prevLength = 0;
+
+    for(size_t i = 0; i < sorted.size(); i++) {
+        const int length = sorted[i].first;
+        if(length == 0)
+            continue;
 
-    for (auto i : sorted) {
-        if (i.first != prev_len)
-            code <<= (i.first - prev_len);
+        code <<= length - prevLength;
+        if(code >> length)
+            return false;
 
-        string binary = "";
-        for (int j = i.first - 1; j >= 0; --j)
-            binary += ((code >> j) & 1) ? '1' : '0';
+        codes[i] = static_cast<uint32_t>(code++);
+        prevLength = length;
 
-        codes[binary] = i.second;
-        code++;
-        prev_len = i.first;
+        if(length > HUFFMAN_TABLE_BITS) {
+            int &bits = subtableBits[codes[i] >> (length - HUFFMAN_TABLE_BITS)];
+            bits = max(bits, length - HUFFMAN_TABLE_BITS);
+        }
     }
-}
 
-void DecompressFile(const string &address, const bool &fileBool, ifstream &file) {
-    if(archive_corrupted)
-        return;
-    
-    unsigned char byte;
-    string binary = bytesFromTheLastRead;
-    int binaryLength = static_cast<int>(binary.length()), binaryPos = 0;
+    for(size_t i = 0; i < subtableBits.size(); i++)
+        if(subtableBits[i] > 0) {
+            decoder.table[i] = HUFFMAN_SUBTABLE | static_cast<uint32_t>(decoder.table.size()) << 8 | (HUFFMAN_TABLE_BITS + subtableBits[i]);
+            decoder.table.resize(decoder.table.size() + (size_t(1) << subtableBits[i]), 0);
+        }
 
-//---------------------------------------------- NAME -----------------------------------------
+    //every entry whose first bits are the code gets its symbol
+    for(size_t i = 0; i < sorted.size(); i++) {
+        const int length = sorted[i].first;
+        if(length == 0)
+            continue;
 
-    if(fileBool == 0) {
-        _mkdir(address.c_str());
+        size_t first, count;
+        if(length <= HUFFMAN_TABLE_BITS) {
+            first = codes[i] << (HUFFMAN_TABLE_BITS - length);
+            count = size_t(1) << (HUFFMAN_TABLE_BITS - length);
+        }
+        else {
+            const uint32_t link = decoder.table[codes[i] >> (length - HUFFMAN_TABLE_BITS)];
+            const int bits = static_cast<int>(link & 255) - HUFFMAN_TABLE_BITS, rest = length - HUFFMAN_TABLE_BITS;
+            first = ((link & ~HUFFMAN_SUBTABLE) >> 8) + (static_cast<size_t>(codes[i] & ((1u << rest) - 1)) << (bits - rest));
+            count = size_t(1) << (bits - rest);
+        }
 
-        return;
+        fill(decoder.table.begin() + first, decoder.table.begin() + first + count, static_cast<uint32_t>(sorted[i].second) << 8 | length);
     }
 
-    ofstream outFile(address, ios::binary);
-    if (!outFile.is_open()) {
-        cerr << "Error opening output file: " << address << endl;
-        archive_corrupted = true;
-        return;
+    return true;
+}
+
+//the table entry of the code at the start of the next HUFFMAN_PEEK_BITS bits
+inline uint32_t HuffmanEntry(const HuffmanDecoder &decoder, const uint64_t &bits) {
+    uint32_t entry = decoder.table[bits >> (HUFFMAN_PEEK_BITS - HUFFMAN_TABLE_BITS)];
+    if(entry & HUFFMAN_SUBTABLE) {
+        const int size = entry & 255;
+        entry = decoder.table[((entry & ~HUFFMAN_SUBTABLE) >> 8) + ((bits >> (HUFFMAN_PEEK_BITS - size)) & ((1u << (size - HUFFMAN_TABLE_BITS)) - 1))];
     }
 
-//------------------------------------------------ LENGTH -------------------------------------
+    return entry;
+}
 
-    if(binaryPos + 9 >= binaryLength)
-        ReadDataToDecompress(binary, file, binaryLength, binaryPos);
+//the symbol of the code at the reader and the length of the code, which is not consumed; a length of 0 means the bits are not a code
+inline int DecodeSymbol(BitReader &reader, const HuffmanDecoder &decoder, int &length) {
+    const uint32_t entry = HuffmanEntry(decoder, reader.Peek(HUFFMAN_PEEK_BITS));
 
-    if(binaryPos + 9 > binaryLength) {
-        archive_corrupted = true;
-        outFile.close();
-        return;
-    }
+    length = entry & 255;
+    return static_cast<int>(entry >> 8);
+}
 
-    int codesSize = 0;
-    for (int i = 0; i < 9; i++) {
-        codesSize <<= 1;
-        if (binary[binaryPos + i] == '1')
-            codesSize |= 1;
-    }
-    binaryPos += 9;
+//the fast path of DecodeTokens, like inflate_fast in zlib: while the reader has enough bytes buffered and the current half of the window
+//has room for the longest match, whole tokens are decoded with one refill before the length and one before the offset, and no other checks
+//returns true when the block ended (or is corrupted), false when DecodeTokens has to continue near the end of the input or of the half
+bool DecodeTokensFast(BitReader &reader, const HuffmanDecoder &lengthDecoder, const HuffmanDecoder &offsetDecoder, unsigned char decompressedBytes[], int &decompressedBytesIdx, const int &windowSize) {
+    //matches are copied 8 bytes at a time, so up to 7 bytes after them are written too
+    const int halfEnd = (decompressedBytesIdx < windowSize ? windowSize : 2 * windowSize) - LOOKAHEAD_SIZE - 8;
+    const int bufferSize = 2 * windowSize;
+    const int offsetCodes = archiveHeader.OffsetCodes();
+
+    unsigned char *out = decompressedBytes + decompressedBytesIdx;
+    unsigned char *const outEnd = decompressedBytes + halfEnd;
+
+    bool finished = false;
+    while(out < outEnd && reader.CanRefillFast()) {
+        reader.RefillFast();
+
+        uint32_t entry = HuffmanEntry(lengthDecoder, reader.PeekFast(HUFFMAN_PEEK_BITS));
+        int codeLength = entry & 255, symbol = static_cast<int>(entry >> 8);
+        if(codeLength == 0) {
+            archive_corrupted = true;
+            finished = true;
+            break;
+        }
+        reader.Consume(codeLength);
+
+        if(symbol < 256) {
+            *out++ = static_cast<unsigned char>(symbol);
+            continue;
+        }
 
-    vector<pair<int, int>> codeLength(codesSize);
-    int codeLengthIdx = 0;
+        if(symbol == 256) {
+            finished = true;
+            break;
+        }
 
+        if(symbol > 285) {
+            cerr << "Error at decompressing the length of the token" << endl;
+            archive_corrupted = true;
+            finished = true;
+            break;
+        }
 
-    if(binaryPos + codesSize * 14 >= binaryLength)
-        ReadDataToDecompress(binary, file, binaryLength, binaryPos);
+        const CodeBase &lengthBase = LENGTH_BASES[symbol - 257];
+        const int length = static_cast<int>(lengthBase.base + reader.PeekFast(lengthBase.extraBits));
+        reader.Consume(lengthBase.extraBits);
 
-    if(binaryPos + codesSize * 14 > binaryLength) {
-        archive_corrupted = true;
-        outFile.close();
-        return;
-    }
+        reader.RefillFast();
 
-    while(codesSize--) {
-        int symbol = 0, symbolLength = 0;
-        for(int i = 0; i < 9; i++) {
-            symbol <<= 1;
-            if(binary[i + binaryPos] == '1')
-                symbol |= 1;
+        entry = HuffmanEntry(offsetDecoder, reader.PeekFast(HUFFMAN_PEEK_BITS));
+        codeLength = entry & 255;
+        symbol = static_cast<int>(entry >> 8);
+        if(codeLength == 0 || symbol >= offsetCodes) {
+            cerr << "Error at decompressing the offset of the token " << endl;
+            archive_corrupted = true;
+            finished = true;
+            break;
         }
-        for(int i = 9; i < 14; i++) {
-            symbolLength <<= 1;
-            if(binary[i + binaryPos] == '1')
-                symbolLength |= 1;
+        reader.Consume(codeLength);
+
+        const int extraBits = OffsetExtraBits(symbol);
+        const int offset = static_cast<int>(OffsetBase(symbol) + reader.PeekFast(extraBits));
+        reader.Consume(extraBits);
+        if(offset > windowSize) {
+            cerr << "Error at decompressing the offset of the token " << endl;
+            archive_corrupted = true;
+            finished = true;
+            break;
         }
-        binaryPos += 14;
 
-        codeLength[codeLengthIdx++] = {symbolLength, symbol};
+        //the match may start in the other half of the window, from the end of the buffer
+        int start = static_cast<int>(out - decompressedBytes) - offset;
+        if(start < 0)
+            start += bufferSize;
+        const unsigned char *from = decompressedBytes + start;
+
+        if(start + length + 8 > bufferSize) {
+            //it wraps around the end of the buffer
+            for(int i = 0; i < length; i++) {
+                *out++ = *from++;
+                if(from == decompressedBytes + bufferSize)
+                    from = decompressedBytes;
+            }
+        }
+        else if(offset >= 8) {
+            //every 8 bytes read were written before, even when the match overlaps itself
+            unsigned char *const end = out + length;
+            for(; out < end; out += 8, from += 8)
+                memcpy(out, from, 8);
+            out = end;
+        }
+        else
+            for(int i = 0; i < length; i++)
+                *out++ = *from++;
     }
 
-    sort(codeLength.begin(), codeLength.end());
-    unordered_map<string, int> reverseCodes;
-    reverseCodes.reserve(codesSize);
-    ReverseCode(codeLength, reverseCodes);
+    decompressedBytesIdx = static_cast<int>(out - decompressedBytes);
+    return finished;
+}
+
+//decodes the tokens of a block up to end-of-block into the window buffer, which is written to outFile as it fills
+void DecodeTokens(BitReader &reader, const HuffmanDecoder &lengthDecoder, const HuffmanDecoder &offsetDecoder, unsigned char decompressedBytes[], int &decompressedBytesIdx, ostream &outFile) {
+    const int windowSize = static_cast<int>(archiveHeader.WindowSize());
+
+    LZ77 token;
+    int codeLength;
+
+    //the careful path decodes single tokens near the end of the input and where the output reaches the next half of the window
+    while(!archive_corrupted) {
+        if(DecodeTokensFast(reader, lengthDecoder, offsetDecoder, decompressedBytes, decompressedBytesIdx, windowSize))
+            return;
+
+        int symbol = DecodeSymbol(reader, lengthDecoder, codeLength);
+        reader.Consume(codeLength);
+        if(codeLength == 0 || reader.Overrun()) {
+            archive_corrupted = true;
+            return;
+        }
+
+        if(symbol < 256) {
+            token.character = static_cast<unsigned char>(symbol);
+            token.offset = 0;
+            token.length = 0;
+
+            WriteTokenToFile(token, decompressedBytes, decompressedBytesIdx, windowSize, outFile);
+
+            continue;
+        }
+
+        if(symbol == 256)
+            return;
+
+        if(symbol > 285) {
+            cerr << "Error at decompressing the length of the token" << endl;
+            archive_corrupted = true;
+
+            return;
+        }
+
+        token.length = static_cast<uint16_t>(LENGTH_BASES[symbol - 257].base + reader.Read(LENGTH_BASES[symbol - 257].extraBits));
+        token.character = '-';
+
+        symbol = DecodeSymbol(reader, offsetDecoder, codeLength);
+        reader.Consume(codeLength);
+        if(codeLength == 0 || symbol >= archiveHeader.OffsetCodes()) {
+            cerr << "Error at decompressing the offset of the token " << endl;
+            archive_corrupted = true;
+
+            return;
+        }
+
+        token.offset = OffsetBase(symbol) + static_cast<uint32_t>(reader.Read(OffsetExtraBits(symbol)));
+        if(static_cast<int>(token.offset) > windowSize) {
+            cerr << "Error at decompressing the offset of the token " << endl;
+            archive_corrupted = true;
+
+            return;
+        }
 
-//------------------------------------------------ OFFSET -------------------------------------
+        WriteTokenToFile(token, decompressedBytes, decompressedBytesIdx, windowSize, outFile);
+    }
+}
 
-    if(binaryPos + 5 >= binaryLength)
-        ReadDataToDecompress(binary, file, binaryLength, binaryPos);
+//reads the code tables of a dynamic block as {length, symbol} pairs, in the order they were written
+void ReadCodeLengths(BitReader &reader, vector<pair<int, int>> &codeLength, vector<pair<int, int>> &offsetCodes) {
+    codeLength.resize(reader.Read(9));
+    for(auto &i : codeLength) {
+        i.second = static_cast<int>(reader.Read(9));
+        i.first = static_cast<int>(reader.Read(5));
+    }
 
-    if(binaryPos + 5 > binaryLength) {
+    const int codes = archiveHeader.OffsetCodes(), symbolBits = OffsetSymbolBits(codes);
+    int codesSize = static_cast<int>(reader.Read(OffsetCountBits(codes)));
+    if(codesSize > codes) {
         archive_corrupted = true;
-        outFile.close();
         return;
     }
-    
-    codesSize = 0;
-    for (int i = 0; i < 5; i++) {
-        codesSize <<= 1;
-        if (binary[i + binaryPos] == '1')
-            codesSize |= 1;
+
+    offsetCodes.resize(codesSize);
+    for(auto &i : offsetCodes) {
+        i.second = static_cast<int>(reader.Read(symbolBits));
+        i.first = static_cast<int>(reader.Read(4));
     }
-    binaryPos += 5;
 
-    vector<pair<int, int>> offsetCodes(codesSize);
-    int offsetCodesIdx = 0;
+    if(reader.Overrun())
+        archive_corrupted = true;
+}
+
+//decodes one dynamic block: its code tables, then its tokens
+void DecompressBlock(BitReader &reader, unsigned char decompressedBytes[], int &decompressedBytesIdx, ostream &outFile) {
+    vector<pair<int, int>> codeLength, offsetCodes;
+    ReadCodeLengths(reader, codeLength, offsetCodes);
+    if(archive_corrupted)
+        return;
 
-    if(binaryPos + codesSize * 9 >= binaryLength)
-        ReadDataToDecompress(binary, file, binaryLength, binaryPos);
+    sort(codeLength.begin(), codeLength.end());
+    sort(offsetCodes.begin(), offsetCodes.end());
 
-    if(binaryPos + codesSize * 9 > binaryLength) {
+    HuffmanDecoder lengthDecoder, offsetDecoder;
+    if(!BuildHuffmanDecoder(codeLength, lengthDecoder) || !BuildHuffmanDecoder(offsetCodes, offsetDecoder)) {
+        cerr << "Invalid Huffman code lengths" << endl;
         archive_corrupted = true;
-        outFile.close();
         return;
     }
 
-    while(codesSize--) {
-        int symbol = 0, symbolLength = 0;
-        for(int i = 0; i < 5; i++) {
-            symbol <<= 1;
-            if(binary[i + binaryPos] == '1')
-                symbol |= 1;
-        }
-        for(int i = 5; i < 9; i++) {
-            symbolLength <<= 1;
-            if(binary[i + binaryPos] == '1')
-                symbolLength |= 1;
-        }
-        binaryPos += 9;
+    DecodeTokens(reader, lengthDecoder, offsetDecoder, decompressedBytes, decompressedBytesIdx, outFile);
+}
 
-        offsetCodes[offsetCodesIdx++] = {symbolLength, symbol};
-    }
+const HuffmanDecoder& FixedDecoder(const int &size) {
+    static const auto build = [](const int &size) {
+        vector<int> codeLengths = FixedCodeLengths(size);
+        vector<pair<int, int>> sorted;
+        for(int i = 0; i < size; i++)
+            sorted.push_back({codeLengths[i], i});
+        sort(sorted.begin(), sorted.end());
+
+        HuffmanDecoder decoder;
+        BuildHuffmanDecoder(sorted, decoder);
+        return decoder;
+    };
+    static const vector<HuffmanDecoder> decoders = [] {
+        vector<HuffmanDecoder> decoders(287);
+        decoders[286] = build(286);
+        for(int i = 2 * WINDOW_LOG; i <= MAX_OFFSET_CODES; i += 2)
+            decoders[i] = build(i);
 
-    sort(offsetCodes.begin(), offsetCodes.end());
-    unordered_map<string, int> reverseOffsetCodes;
-    reverseOffsetCodes.reserve(codesSize);
-    ReverseCode(offsetCodes, reverseOffsetCodes);
+        return decoders;
+    }();
 
-//------------------------------------------------- READ FILE -----------------------------------------------------------------
+    return decoders[size];
+}
 
-    unsigned char decompressedBytes[WINDOW_SIZE * 2];
-    int decompressedBytesIdx = 0;
-    auto getExtraBytes = [](int sizeLength, int &binaryPos, string &binary) {
-        if(binaryPos + sizeLength > static_cast<int>(binary.length())) {
+//decodes the blocks of a chunk, archives older than the block types hold a single dynamic block without header
+void DecompressBlocks(BitReader &reader, unsigned char decompressedBytes[], int &decompressedBytesIdx, ostream &outFile) {
+    if(archiveHeader.version < BLOCK_TYPES_VERSION) {
+        DecompressBlock(reader, decompressedBytes, decompressedBytesIdx, outFile);
+        return;
+    }
+
+    bool final = false;
+    while(!final && !archive_corrupted) {
+        final = reader.Read(1);
+        int type = static_cast<int>(reader.Read(2));
+        if(reader.Overrun()) {
             archive_corrupted = true;
+            return;
+        }
 
-            return 0;
+        if(type == STORED_BLOCK)
+            ReadStoredBytes(reader, reader.Read(32), decompressedBytes, decompressedBytesIdx, archiveHeader.WindowSize(), outFile);
+        else if(type == FIXED_BLOCK)
+            DecodeTokens(reader, FixedDecoder(286), FixedDecoder(archiveHeader.OffsetCodes()), decompressedBytes, decompressedBytesIdx, outFile);
+        else if(type == DYNAMIC_BLOCK)
+            DecompressBlock(reader, decompressedBytes, decompressedBytesIdx, outFile);
+        else {
+            cerr << "Unknown block type: " << type << endl;
+            archive_corrupted = true;
         }
-        int add = 0;
+    }
+}
 
-        while(sizeLength--)
-            add = add * 2 + (binary[binaryPos++] == '1');
+//decodes a chunk that does not depend on the data before it, on its own thread: errors go to the atomic archive_corrupted
+string DecompressChunk(const string &bytes) {
+    istringstream file(bytes);
+    BitReader reader(file);
+    vector<unsigned char> decompressedBytes(2 * archiveHeader.WindowSize());
+    int decompressedBytesIdx = 0;
+    ostringstream outFile;
 
-        return add;
-    };
+    DecompressBlocks(reader, decompressedBytes.data(), decompressedBytesIdx, outFile);
+    FlushDecompressedBytes(decompressedBytes.data(), decompressedBytesIdx, archiveHeader.WindowSize(), outFile);
 
-    LZ77 token;
-    bool readOffset = false;
-    bool end_of_block = false;
-    string value = "";
-    int pos = 0;
-
-    while(!end_of_block && !archive_corrupted) {
-        if(binaryPos + 14 >= binaryLength)
-            ReadDataToDecompress(binary, file, binaryLength, binaryPos);
-        if(binaryPos > binaryLength) {
+    return outFile.str();
+}
+
+void DecompressChunks(BitReader &reader, unsigned char decompressedBytes[], int &decompressedBytesIdx, ostream &outFile) {
+    const size_t threadCount = max(thread::hardware_concurrency(), 1u);
+    deque<future<string>> pending;
+    bool first = true, final = false;
+
+    while(!final && !archive_corrupted) {
+        final = reader.Read(1);
+        uint64_t bits = reader.Read(CHUNK_LENGTH_BITS);
+        if(reader.Overrun()) {
             archive_corrupted = true;
-            outFile.close();
-            return;
+            break;
         }
 
-        value += binary[binaryPos++];
-
-        if(readOffset) {
-            auto it = reverseOffsetCodes.find(value);
-            if(it != reverseOffsetCodes.end()) {
-                int nr = it -> second;
-                if(nr <= 3)
-                    token.offset = nr + 1;
-                else if(nr <= 5) {
-                    nr = 5 + (nr - 4) * 2 + getExtraBytes(1, binaryPos, binary);
-                    token.offset = nr;
-                }
-                else if(nr <= 7) {
-                    nr = 9 + (nr - 6) * 4 + getExtraBytes(2, binaryPos, binary);
-                    token.offset = nr;
-                }
-                else if(nr <= 9) {
-                    nr = 17 + (nr - 8) * 8 + getExtraBytes(3, binaryPos, binary);
-                    token.offset = nr;
-                }
-                else if(nr <= 11) {
-                    nr = 33 + (nr - 10) * 16 + getExtraBytes(4, binaryPos, binary);
-                    token.offset = nr;
-                }
-                else if(nr <= 13) {
-                    nr = 65 + (nr - 12) * 32 + getExtraBytes(5, binaryPos, binary);
-                    token.offset = nr;
-                }
-                else if(nr <= 15) {
-                    nr = 129 + (nr - 14) * 64 + getExtraBytes(6, binaryPos, binary);
-                    token.offset = nr;
-                }
-                else if(nr <= 17) {
-                    nr = 257 + (nr - 16) * 128 + getExtraBytes(7, binaryPos, binary);
-                    token.offset = nr;
-                }
-                else if(nr <= 19) {
-                    nr = 513 + (nr - 18) * 256 + getExtraBytes(8, binaryPos, binary);
-                    token.offset = nr;
-                }
-                else if(nr <= 21) {
-                    nr = 1025 + (nr - 20) * 512 + getExtraBytes(9, binaryPos, binary);
-                    token.offset = nr;
-                }
-                else if(nr <= 23) {
-                    nr = 2049 + (nr - 22) * 1024 + getExtraBytes(10, binaryPos, binary);
-                    token.offset = nr;
-                }
-                else if(nr <= 25) {
-                    nr = 4097 + (nr - 24) * 2048 + getExtraBytes(11, binaryPos, binary);
-                    token.offset = nr;
-                }
-                else if(nr <= 27) {
-                    nr = 8193 + (nr - 26) * 4096 + getExtraBytes(12, binaryPos, binary);
-                    token.offset = nr;
-                }
-                else if(nr <= 29) {
-                    nr = 16385 + (nr - 28) * 8192 + getExtraBytes(13, binaryPos, binary);
-                    token.offset = nr;
-                }
-                else {
-                    cerr << "Error at decompressing the offset of the token " << endl;
-                    archive_corrupted = true;
-                    outFile.close();
+        //primed chunks need the previous one, a file with a single chunk gains nothing from another thread
+        if(archiveHeader.primedChunks || threadCount == 1 || (first && final)) {
+            DecompressBlocks(reader, decompressedBytes, decompressedBytesIdx, outFile);
+            first = false;
 
-                    return;
-                }
+            continue;
+        }
+        first = false;
 
-                value = "";
+        //the chunk is copied to a byte aligned buffer of its own, the thread reads it from there
+        ostringstream chunkStream;
+        BitWriter chunkWriter(chunkStream);
+        reader.CopyBits(bits, chunkWriter);
+        chunkWriter.Finish();
+        if(reader.Overrun()) {
+            archive_corrupted = true;
+            break;
+        }
 
-                WriteTokenToFile(token, decompressedBytes, decompressedBytesIdx, outFile);
+        pending.push_back(async(launch::async, DecompressChunk, chunkStream.str()));
 
-                readOffset = false;
-            }
+        if(pending.size() >= threadCount * PENDING_STREAMS_PER_THREAD) {
+            outFile << pending.front().get();
+            pending.pop_front();
         }
-        else {
-            auto it = reverseCodes.find(value);
-            if(it != reverseCodes.end()) {
-                if(it -> second < 256) {
-                    token.character = static_cast<unsigned char>(it -> second);
-                    token.offset = 0;
-                    token.length = 0;
+    }
 
-                    WriteTokenToFile(token, decompressedBytes, decompressedBytesIdx, outFile);
+    while(!pending.empty()) {
+        outFile << pending.front().get();
+        pending.pop_front();
+    }
+}
 
-                    value = "";
-                }
-                else if(it -> second == 256) {
-                    bytesFromTheLastRead = binary.substr(binaryPos);
-                    end_of_block = true;
+//decompresses the next file of the reader, or the file of entry when the archive has a directory
+void DecompressFile(const string &address, const bool &fileBool, BitReader &reader, const DirectoryEntry *entry = nullptr) {
+    if(archive_corrupted)
+        return;
 
-                    break;
-                }
-                else {
-                    int nr = it -> second;
-                    if(nr <= 264)
-                        nr = nr - 257 + 3;
-                    else if(nr <= 268) {
-                        nr = 11 + (nr - 265) * 2 + getExtraBytes(1, binaryPos, binary);
-                    }
-                    else if(nr <= 272) {
-                        nr = 19 + (nr - 269) * 4 + getExtraBytes(2, binaryPos, binary);
-                    }
-                    else if(nr <= 276) {
-                        nr = 35 + (nr - 273) * 8 + getExtraBytes(3, binaryPos, binary);
-                    }
-                    else if(nr <= 280) {
-                        nr = 67 + (nr - 277) * 16 + getExtraBytes(4, binaryPos, binary);
-                    }
-                    else if(nr <= 284) {
-                        nr = 131 + (nr - 281) * 32 + getExtraBytes(5, binaryPos, binary);
-                    }
-                    else if(nr == 285)
-                        nr = 258;
-                    else {
-                        cerr << "Error at decompressing the length of the token" << endl;
-                        archive_corrupted = true;
-                        outFile.close();
+//---------------------------------------------- NAME -----------------------------------------
+
+    if(fileBool == 0) {
+        _mkdir(address.c_str());
+
+        return;
+    }
+
+    ofstream outFile(address, ios::binary);
+    if (!outFile.is_open()) {
+        cerr << "Error opening output file: " << address << endl;
+        archive_corrupted = true;
+        return;
+    }
 
-                        return;
-                    }
-                    
-                    token.length = nr;
-                    token.character = '-';
-                    readOffset = true;
+    //the decompressed bytes of a file with an entry go through its checksum
+    ChecksumBuffer checksum(outFile.rdbuf());
+    ostream out(entry ? static_cast<streambuf*>(&checksum) : outFile.rdbuf());
+    if(entry)
+        reader.Seek(entry->offset);
 
-                    value = "";
-                }
-            }
-        }
+    //the window of the archive, up to 16 MiB, so it is not kept on the stack
+    vector<unsigned char> decompressedBytes(2 * archiveHeader.WindowSize());
+    int decompressedBytesIdx = 0;
+
+    if(archiveHeader.version == 0)
+        DecompressBlocks(reader, decompressedBytes.data(), decompressedBytesIdx, out);
+    else
+        DecompressChunks(reader, decompressedBytes.data(), decompressedBytesIdx, out);
+
+    FlushDecompressedBytes(decompressedBytes.data(), decompressedBytesIdx, archiveHeader.WindowSize(), out);
+
+    if(entry && !archive_corrupted && (checksum.Size() != entry->size || checksum.Checksum() != entry->checksum)) {
+        cerr << "Checksum mismatch: " << address << endl;
+        archive_corrupted = true;
     }
 
-    if(decompressedBytesIdx > 0 && decompressedBytesIdx < WINDOW_SIZE)
-        outFile.write(reinterpret_cast<char*>(decompressedBytes), decompressedBytesIdx);
-    else if(decompressedBytesIdx > 0)
-        outFile.write(reinterpret_cast<char*>(decompressedBytes + WINDOW_SIZE), decompressedBytesIdx - WINDOW_SIZE);
-   
     outFile.close();
 }
 
 void Decompress(const string &toDecompressFolderAddress, const string &compressedFileAddress) {
     archive_corrupted = false;
 
-    bytesFromTheLastRead = "";
-    writeBufferIndex = 0;
-    byteIndex = 0;
-
     ifstream file(compressedFileAddress, ios::binary);
     if(!file) {
         archive_corrupted = true;
         return;
     }
 
-    string binary = bytesFromTheLastRead;
-    int binaryLength = static_cast<int>(binary.length()), binaryPos = 0;
-    vector<pair<string, bool>> addresses; // 1 - file; 0 - folder
-
-    uint8_t fileNameLen = 0;
-
-    if(binaryLength < 8)
-        ReadDataToDecompress(binary, file, binaryLength, binaryPos);
-
-    if(binaryLength < 8) {
-        archive_corrupted = true;
+    BitReader reader(file);
+    archiveDirectory = ArchiveDirectory();
+    if(!ReadArchiveHeader(reader, archiveHeader) || (archiveHeader.version >= DIRECTORY_VERSION && !SeekDirectory(reader))) {
         file.close();
         return;
     }
-    
-    while(binaryPos < 8)
-        fileNameLen = fileNameLen * 2 + (binary[binaryPos++] == '1');
+
+    vector<pair<string, bool>> addresses; // 1 - file; 0 - folder
+
+    uint8_t fileNameLen = static_cast<uint8_t>(reader.Read(8));
     
     string newDecompressAddress = toDecompressFolderAddress;
     string folderAddress = newDecompressAddress;
@@ -1130,7 +1965,7 @@ void Decompress(const string &toDecompressFolderAddress, const string &compresse
 
     int len = 0;
 
-    while(fileNameLen != 0 || folderAddress != newDecompressAddress) {
+    while((fileNameLen != 0 || folderAddress != newDecompressAddress) && !reader.Overrun()) {
         if(fileNameLen == 0) {
             while(folderAddress != "" && folderAddress != compressedFileAddress && folderAddress.back() != '/')
                 folderAddress.pop_back();
@@ -1139,19 +1974,7 @@ void Decompress(const string &toDecompressFolderAddress, const string &compresse
                 folderAddress.pop_back();
 
             addresses.push_back({"", 0});
-            
-            if(8 + binaryPos >= binaryLength)
-                ReadDataToDecompress(binary, file, binaryLength, binaryPos);
-
-            if(8 + binaryPos > binaryLength) {
-                archive_corrupted = true;
-                file.close();
-                return;
-            }
-        
-            fileNameLen = 0;
-            for(int i = 0; i < 8; i++)
-                fileNameLen = fileNameLen * 2 + (binary[binaryPos++] == '1');
+            fileNameLen = static_cast<uint8_t>(reader.Read(8));
 
             continue;
         }
@@ -1160,50 +1983,34 @@ void Decompress(const string &toDecompressFolderAddress, const string &compresse
         if(newFilePath != "" && newFilePath[newFilePath.length() - 1] != '/')
             newFilePath += "/";
 
-        if(binaryPos + 8 * fileNameLen + 1 >= binaryLength)
-            ReadDataToDecompress(binary, file, binaryLength, binaryPos);
-
-        if(binaryPos + 8 * fileNameLen + 1 > binaryLength) {
-            archive_corrupted = true;
-            file.close();
-            return;
-        }
-
-        for(int i = 0; i < fileNameLen; i++) {
-            char tempVal = 0;
-            for(int j = 0; j < 8; j++)
-                tempVal = tempVal * 2 + (binary[binaryPos + j] == '1');
-        
-            binaryPos += 8;
-            newFilePath += tempVal;
-        }
+        for(int i = 0; i < fileNameLen; i++)
+            newFilePath += static_cast<char>(reader.Read(8));
 
-        if(binary[binaryPos] == '0')
+        bool isFile = reader.Read(1);
+        if(!isFile)
             folderAddress = newFilePath;
-        addresses.push_back({newFilePath, binary[binaryPos++] == '1'});
+        addresses.push_back({newFilePath, isFile});
 
-        if(addresses.back().second) 
+        if(isFile)
             len++;
 
-        if(8 + binaryPos >= binaryLength)
-            ReadDataToDecompress(binary, file, binaryLength, binaryPos);
+        fileNameLen = static_cast<uint8_t>(reader.Read(8));
+    }
 
-        if(binaryPos + 8 > binaryLength) {
-            archive_corrupted = true;
-            file.close();
-            return;
-        }
-        
-        fileNameLen = 0;
-        for(int i = 0; i < 8; i++)
-            fileNameLen = fileNameLen * 2 + (binary[binaryPos++] == '1');
+    if(reader.Overrun()) {
+        archive_corrupted = true;
+        file.close();
+        return;
     }
 
-    bytesFromTheLastRead = binary.substr(binaryPos);
+    const bool directory = archiveHeader.version >= DIRECTORY_VERSION;
+    if(directory)
+        ReadDirectoryEntries(reader, len);
 
+    size_t entry = 0;
     for(auto i : addresses)
         if(i.first != "") {
-            DecompressFile(i.first, i.second, file);
+            DecompressFile(i.first, i.second, reader, directory && i.second ? &archiveDirectory.entries[entry++] : nullptr);
 
             *progress += 1.0 / len;
         }
@@ -1218,655 +2025,467 @@ void Decompress(const string &toDecompressFolderAddress, const string &compresse
 
 //---------------------------------------------------- ARCHIVE OPERATIONS SECTION --------------------------------------------------
 
-void TravelFile(ifstream &file, ofstream &outFile) {
-    if(archive_corrupted)
-        return;
-    
-    unsigned char byte;
-    string binary = bytesFromTheLastRead;
-    int binaryLength = static_cast<int>(binary.length()), binaryPos = 0;
-
-//------------------------------------------------ LENGTH -------------------------------------
+//copies the chunks of a file to writer (or skips them when writer is null) using the length written before each chunk
+void TravelChunks(BitReader &reader, BitWriter *writer) {
+    bool final = false;
 
-    if(binaryPos + 9 >= binaryLength)
-        ReadDataToDecompress(binary, file, binaryLength, binaryPos);
-    
-    if(binaryPos + 9 > binaryLength) {
-        archive_corrupted = true;
-        return;
-    }
+    while(!final && !archive_corrupted) {
+        final = reader.Read(1);
+        uint64_t bits = reader.Read(CHUNK_LENGTH_BITS);
+        if(reader.Overrun()) {
+            archive_corrupted = true;
+            return;
+        }
 
-    int codesSize = 0;
-    for (int i = 0; i < 9; i++) {
-        codesSize <<= 1;
-        if (binary[binaryPos + i] == '1')
-            codesSize |= 1;
+        if(writer) {
+            writer->Put(final, 1);
+            writer->Put(bits, CHUNK_LENGTH_BITS);
+            reader.CopyBits(bits, *writer);
+        }
+        else
+            reader.SkipBits(bits);
     }
-    binaryPos += 9;
-    WriteToBufferBig(outFile, codesSize, 9);
 
-    vector<pair<int, int>> codeLength(codesSize);
-    int codeLengthIdx = 0;
-
-
-    if(binaryPos + codesSize * 14 >= binaryLength)
-        ReadDataToDecompress(binary, file, binaryLength, binaryPos);
-
-    if(binaryPos + codesSize * 14 > binaryLength) {
+    if(reader.Overrun())
         archive_corrupted = true;
-        return;
-    }
+}
 
-    while(codesSize--) {
-        int symbol = 0, symbolLength = 0;
-        for(int i = 0; i < 9; i++) {
-            symbol <<= 1;
-            if(binary[i + binaryPos] == '1')
-                symbol |= 1;
-        }
-        WriteToBufferBig(outFile, symbol, 9);
-        for(int i = 9; i < 14; i++) {
-            symbolLength <<= 1;
-            if(binary[i + binaryPos] == '1')
-                symbolLength |= 1;
-        }
-        WriteToBuffer(outFile, symbolLength, 5);
-        binaryPos += 14;
+//copies the next file of the archive to writer, or skips it when writer is null
+void TravelFile(BitReader &reader, BitWriter *writer = nullptr) {
+    if(archive_corrupted)
+        return;
 
-        codeLength[codeLengthIdx++] = {symbolLength, symbol};
+    if(archiveHeader.version > 0) {
+        TravelChunks(reader, writer);
+        return;
     }
 
-    sort(codeLength.begin(), codeLength.end());
-    unordered_map<string, int> reverseCodes;
-    reverseCodes.reserve(codesSize);
-    ReverseCode(codeLength, reverseCodes);
+    //an old archive has no chunk lengths, the single block of the file is decoded to find its end
+    vector<pair<int, int>> codeLength, offsetCodes;
+    ReadCodeLengths(reader, codeLength, offsetCodes);
+    if(archive_corrupted)
+        return;
 
-//------------------------------------------------ OFFSET -------------------------------------
+    if(writer) {
+        const int codes = archiveHeader.OffsetCodes();
 
-    if(binaryPos + 5 >= binaryLength)
-        ReadDataToDecompress(binary, file, binaryLength, binaryPos);
+        writer->Put(codeLength.size(), 9);
+        for(const auto &i : codeLength) {
+            writer->Put(i.second, 9);
+            writer->Put(i.first, 5);
+        }
 
-    if(binaryPos + 5 > binaryLength) {
-        archive_corrupted = true;
-        return;
-    }
-    
-    codesSize = 0;
-    for (int i = 0; i < 5; i++) {
-        codesSize <<= 1;
-        if (binary[i + binaryPos] == '1')
-            codesSize |= 1;
+        writer->Put(offsetCodes.size(), OffsetCountBits(codes));
+        for(const auto &i : offsetCodes) {
+            writer->Put(i.second, OffsetSymbolBits(codes));
+            writer->Put(i.first, 4);
+        }
     }
-    WriteToBuffer(outFile, codesSize, 5);
-    binaryPos += 5;
 
-    vector<pair<int, int>> offsetCodes(codesSize);
-    int offsetCodesIdx = 0;
-
-    if(binaryPos + codesSize * 9 >= binaryLength)
-        ReadDataToDecompress(binary, file, binaryLength, binaryPos);
+    sort(codeLength.begin(), codeLength.end());
+    sort(offsetCodes.begin(), offsetCodes.end());
 
-    if(binaryPos + codesSize * 9 > binaryLength) {
+    HuffmanDecoder lengthDecoder, offsetDecoder;
+    if(!BuildHuffmanDecoder(codeLength, lengthDecoder) || !BuildHuffmanDecoder(offsetCodes, offsetDecoder)) {
+        cerr << "Invalid Huffman code lengths" << endl;
         archive_corrupted = true;
         return;
     }
 
-    while(codesSize--) {
-        int symbol = 0, symbolLength = 0;
-        for(int i = 0; i < 5; i++) {
-            symbol <<= 1;
-            if(binary[i + binaryPos] == '1')
-                symbol |= 1;
-        }
-        WriteToBuffer(outFile, symbol, 5);
-        for(int i = 5; i < 9; i++) {
-            symbolLength <<= 1;
-            if(binary[i + binaryPos] == '1')
-                symbolLength |= 1;
-        }
-        WriteToBuffer(outFile, symbolLength, 4);
-        binaryPos += 9;
-
-        offsetCodes[offsetCodesIdx++] = {symbolLength, symbol};
-    }
+//------------------------------------------------- READ FILE -----------------------------------------------------------------
 
-    sort(offsetCodes.begin(), offsetCodes.end());
-    unordered_map<string, int> reverseOffsetCodes;
-    reverseOffsetCodes.reserve(codesSize);
-    ReverseCode(offsetCodes, reverseOffsetCodes);
+    //every bit read is copied as it is
+    auto copyBits = [&](const int &size) {
+        uint64_t value = reader.Read(size);
+        if(writer)
+            writer->Put(value, size);
+    };
 
-//------------------------------------------------- READ FILE -----------------------------------------------------------------
+    int length;
 
-    unsigned char decompressedBytes[WINDOW_SIZE * 2];
-    int decompressedBytesIdx = 0;
-    auto getExtraBytes = [](int sizeLength, int &binaryPos, string &binary, string &value) {
-        if(binaryPos + sizeLength > static_cast<int>(binary.length())) {
+    while(!archive_corrupted) {
+        int symbol = DecodeSymbol(reader, lengthDecoder, length);
+        if(length == 0 || reader.Overrun()) {
             archive_corrupted = true;
-
             return;
         }
+        copyBits(length);
 
-        while(sizeLength--)
-            value += binary[binaryPos++];
-    };
+        if(symbol == 256)
+            return;
 
-    LZ77 token;
-    bool readOffset = false;
-    bool end_of_block = false;
-    string value = "";
-    int pos = 0;
-
-    while(!end_of_block && !archive_corrupted) {
-        if(binaryPos + 14 >= binaryLength)
-            ReadDataToDecompress(binary, file, binaryLength, binaryPos);
-        if(binaryPos > binaryLength) {
-            cout << "ERROR - No data: " << binaryPos << ' ' << binaryLength << ' ' << binary.length() << endl;
+        if(symbol > 285) {
+            cerr << "Error at decompressing the length of the token" << endl;
             archive_corrupted = true;
             return;
         }
-        value += binary[binaryPos++];
-
-        if(readOffset) {
-            auto it = reverseOffsetCodes.find(value);
-            if(it != reverseOffsetCodes.end()) {
-                int nr = it -> second;
-                if(nr <= 3)
-                    token.offset = nr + 1;
-                else if(nr <= 5) {
-                    getExtraBytes(1, binaryPos, binary, value);
-                }
-                else if(nr <= 7) {
-                    getExtraBytes(2, binaryPos, binary, value);
-                }
-                else if(nr <= 9) {
-                    getExtraBytes(3, binaryPos, binary, value);
-                }
-                else if(nr <= 11) {
-                    getExtraBytes(4, binaryPos, binary, value);
-                }
-                else if(nr <= 13) {
-                    getExtraBytes(5, binaryPos, binary, value);
-                }
-                else if(nr <= 15) {
-                    getExtraBytes(6, binaryPos, binary, value);
-                }
-                else if(nr <= 17) {
-                    getExtraBytes(7, binaryPos, binary, value);
-                }
-                else if(nr <= 19) {
-                    getExtraBytes(8, binaryPos, binary, value);
-                }
-                else if(nr <= 21) {
-                    getExtraBytes(9, binaryPos, binary, value);
-                }
-                else if(nr <= 23) {
-                    getExtraBytes(10, binaryPos, binary, value);
-                }
-                else if(nr <= 25) {
-                    getExtraBytes(11, binaryPos, binary, value);
-                }
-                else if(nr <= 27) {
-                    getExtraBytes(12, binaryPos, binary, value);
-                }
-                else if(nr <= 29) {
-                    getExtraBytes(13, binaryPos, binary, value);
-                }
-                else {
-                    cerr << "Error at decompressing the offset of the code" << endl;
-                    archive_corrupted = true;
-                    return;
-                }
-
-                unsigned char tempByte = 0, tempByteIdx = 0;
-
-                for(char c : value) {
-                    tempByte = (tempByte << 1) + (c == '1');
-                    tempByteIdx++;
 
-                    if(tempByteIdx == 8) {
-                        WriteToBuffer(outFile, tempByte);
+        if(symbol > 256) {
+            copyBits(LENGTH_BASES[symbol - 257].extraBits);
 
-                        tempByteIdx = 0;
-                        tempByte = 0;
-                    }
-                }
-
-                if(tempByteIdx > 0) {
-                    WriteToBuffer(outFile, tempByte, tempByteIdx);
-                }
-
-                value = "";
-
-                readOffset = false;
+            symbol = DecodeSymbol(reader, offsetDecoder, length);
+            if(length == 0 || symbol >= 2 * WINDOW_LOG) {
+                cerr << "Error at decompressing the offset of the code" << endl;
+                archive_corrupted = true;
+                return;
             }
+            copyBits(length);
+            copyBits(OFFSET_BASES[symbol].extraBits);
         }
-        else {
-            auto it = reverseCodes.find(value);
-            if(it != reverseCodes.end()) {
-                if(it -> second <= 256) {
-                    unsigned char tempByte = 0, tempByteIdx = 0;
-
-                    for(char c : value) {
-                        tempByte = (tempByte << 1) + (c == '1');
-                        tempByteIdx++;
+    }
+}
 
-                        if(tempByteIdx == 8) {
-                            WriteToBuffer(outFile, tempByte);
+//copies the stream of a file of an archive with a directory after what writer has, rewrite gets where it went
+//the copy starts at a byte: a stream that starts at a byte too is copied as whole bytes, straight from the reader buffer
+//to the stream of the writer, and only streams of archives written before they were aligned are shifted bit by bit
+//a large one is copied from file to file by the system instead, see CopyFileRange
+void CopyEntry(BitReader &reader, const DirectoryEntry &entry, BitWriter &writer, ArchiveRewrite &rewrite) {
+    if(archive_corrupted)
+        return;
 
-                            tempByteIdx = 0;
-                            tempByte = 0;
-                        }
-                    }
-                    if(tempByteIdx > 0) {
-                        WriteToBuffer(outFile, tempByte, tempByteIdx);
-                    }
-                }
+    writer.Align();
 
-                if(it -> second < 256) {
-                    value = "";
-                }
-                else if(it -> second == 256) {
-                    bytesFromTheLastRead = binary.substr(binaryPos);
-                    end_of_block = true;
+    const uint64_t bytes = (entry.bits + 7) / 8;
+    if(entry.offset % 8 == 0 && bytes >= SYSTEM_COPY_MIN_SIZE && !rewrite.from.empty()) {
+        //the padding puts the stream at the same place in its cluster as in the old file, so its whole clusters can be cloned
+        const uint32_t cluster = rewrite.cloneCluster;
+        if(cluster > 0)
+            for(uint64_t padding = (entry.offset / 8 % cluster + cluster - writer.Position() / 8 % cluster) % cluster; padding > 0; padding--)
+                writer.Put(0, 8);
 
-                    break;
-                }
-                else {
-                    int nr = it -> second;
-                    if(nr <= 264)
-                        nr = nr - 257 + 3;
-                    else if(nr <= 268) {
-                        getExtraBytes(1, binaryPos, binary, value);
-                    }
-                    else if(nr <= 272) {
-                        getExtraBytes(2, binaryPos, binary, value);
-                    }
-                    else if(nr <= 276) {
-                        getExtraBytes(3, binaryPos, binary, value);
-                    }
-                    else if(nr <= 280) {
-                        getExtraBytes(4, binaryPos, binary, value);
-                    }
-                    else if(nr <= 284) {
-                        getExtraBytes(5, binaryPos, binary, value);
-                    }
-                    else if(nr == 285)
-                        nr = 258;
-                    else {
-                        cout << "Error at decompressing the length of the token" << endl;
-                        archive_corrupted = true;
-                        return;
-                    }
+        writer.Sync();
+        if(CopyFileRange(rewrite.from, entry.offset / 8, rewrite.to, writer.Position() / 8, bytes, cluster)) {
+            rewrite.entries.push_back({writer.Position(), entry.bits, entry.size, entry.checksum});
+            writer.Skip(bytes);
+            return;
+        }
+    }
 
-                    unsigned char tempByte = 0, tempByteIdx = 0;
+    reader.Seek(entry.offset);
+    rewrite.entries.push_back({writer.Position(), entry.bits, entry.size, entry.checksum});
+    reader.CopyBits(entry.offset % 8 == 0 ? (entry.bits + 7) / 8 * 8 : entry.bits, writer);
 
-                    for(char c : value) {
-                        tempByte = (tempByte << 1) + (c == '1');
-                        tempByteIdx++;
+    if(reader.Overrun())
+        archive_corrupted = true;
+}
 
-                        if(tempByteIdx == 8) {
-                            WriteToBuffer(outFile, tempByte);
+//the same for the edit operations, a file of an archive with a directory is found through entry number rewrite.next
+void TravelFile(BitReader &reader, BitWriter *writer, ArchiveRewrite &rewrite) {
+    if(archiveHeader.version < DIRECTORY_VERSION) {
+        TravelFile(reader, writer);
+        return;
+    }
 
-                            tempByteIdx = 0;
-                            tempByte = 0;
-                        }
-                    }
+    const DirectoryEntry &entry = archiveDirectory.entries[rewrite.next++];
+    if(writer)
+        CopyEntry(reader, entry, *writer, rewrite);
+}
 
-                    if(tempByteIdx > 0) {
-                        WriteToBuffer(outFile, tempByte, tempByteIdx);
-                    }
-                    
-                    readOffset = true;
-                    value = "";
-                }
-            }
-        }
+//the large streams of an archive with a directory are copied from the file from to the file to by the system
+ArchiveRewrite StartRewrite(const string &from, const string &to) {
+    ArchiveRewrite rewrite;
+    if(archiveHeader.version >= DIRECTORY_VERSION) {
+        rewrite.from = from;
+        rewrite.to = to;
+        rewrite.cloneCluster = CloneClusterSize(from, to);
     }
+
+    return rewrite;
 }
 
-void InsertFile(const string &fileToCompress, const string &compressedFile, const int &index, float &prog) {
-    archive_corrupted = false;
-    prog = 0;
-    progress = &prog;
+//an archive that is written again is first renamed next to itself: on the same volume the rename never copies it,
+//and the clusters of its streams can be cloned into the new file
+string OldArchiveAddress(const string &compressedFile) {
+    int idx = 0;
+    while(idx < INT_MAX && FileExists(compressedFile + ".old_" + to_string(idx)))
+        idx++;
 
-    int temp_file_idx = 0;
-    writeBufferIndex = 0;
-    byteIndex = 0;
-    bytesFromTheLastRead = "";
-    string compressedFileName = "";
+    return compressedFile + ".old_" + to_string(idx);
+}
 
-    for(int i = static_cast<int>(compressedFile.length()) - 1; i >= 0 && compressedFile[i] != '\\' && compressedFile[i] != '/'; i--)
-        compressedFileName += compressedFile[i];
-    reverse(compressedFileName.begin(), compressedFileName.end());
+//writes an archive with a directory again with only the streams of its entries, in their order, which gives back the
+//dead space that edits leave; archives without a directory have none and are left as they are
+//share - the part of the progress bar it takes
+void CompactArchive_help(const string &compressedFile, const float &share) {
+    ifstream file(compressedFile, ios::binary);
+    if(!file) {
+        archive_corrupted = true;
+        return;
+    }
+    BitReader reader(file);
+    ArchiveHeader header;
+    if(!ReadArchiveHeader(reader, header) || header.version < DIRECTORY_VERSION) {
+        file.close();
+        return;
+    }
+    file.close();
 
-    while(temp_file_idx < INT_MAX && FileExists(filesystem::temp_directory_path().string() + compressedFileName + "_" + to_string(temp_file_idx) + ".txt"))
-        temp_file_idx++;
+    const string oldFileAddress = OldArchiveAddress(compressedFile);
 
-    rename(compressedFile.c_str(), (filesystem::temp_directory_path().string() + compressedFileName + "_" + to_string(temp_file_idx) + ".txt").c_str());
-    ifstream oldFile(filesystem::temp_directory_path().string() + compressedFileName + "_" + to_string(temp_file_idx) + ".txt", ios::binary);
+    if(rename(compressedFile.c_str(), oldFileAddress.c_str()) != 0) {
+        archive_corrupted = true;
+        return;
+    }
+    ifstream oldFile(oldFileAddress, ios::binary);
     if(!oldFile) {
         archive_corrupted = true;
+        rename(oldFileAddress.c_str(), compressedFile.c_str());
         return;
     }
-    vector<pair<string, bool>> addresses = GetCompressedFilesWithFile(oldFile);
+    BitReader oldReader(oldFile);
+    vector<pair<string, bool>> addresses = GetCompressedFilesWithFile(oldReader);
 
-    if(archive_corrupted)
+    if(archive_corrupted) {
+        oldFile.close();
+        rename(oldFileAddress.c_str(), compressedFile.c_str());
         return;
+    }
 
     ofstream newFile(compressedFile, ios::binary);
     if(!newFile) {
         archive_corrupted = true;
         oldFile.close();
-        remove((filesystem::temp_directory_path().string() + compressedFileName + "_" + to_string(temp_file_idx) + ".txt").c_str());
+        rename(oldFileAddress.c_str(), compressedFile.c_str());
         return;
     }
-    string folderPath = "";
-    int real_index = 0;
-    vector<string> addresses_newFile;
+    BitWriter writer(newFile);
+    WriteArchiveHeader(writer, archiveHeader);
 
-    for(int i = 0; i < addresses.size(); i++) {
-        if(i == index)
-            CompressNames(fileToCompress, newFile, addresses_newFile);
-        
-        if(addresses[i].first != "") {
-            CompressFileName(addresses[i].first, newFile, addresses[i].second);
-            real_index++;
-        }
+    ostringstream namesStream;
+    BitWriter namesWriter(namesStream);
+    for(auto i : addresses) {
+        if(i.first != "")
+            CompressFileName(i.first, namesWriter, i.second);
         else
-            WriteToBuffer(newFile, 0);
+            namesWriter.Put(0, 8);
     }
+    namesWriter.Put(0, 8);
 
-    WriteToBuffer(newFile, 0);
+    *progress += 0.1f * share;
 
-    *progress = 0.1f;
-    
-    int len = 0;
-    for(auto i : addresses)
-        len += i.second;
-    for(auto i : addresses_newFile)
-        if(!is_directory(i))
-            len++;
+    ArchiveRewrite rewrite = StartRewrite(oldFileAddress, compressedFile);
+    const size_t files = archiveDirectory.entries.size();
+    for(size_t i = 0; i < files; i++) {
+        TravelFile(oldReader, &writer, rewrite);
 
-    for(int i = 0; i < index; i++)
-        if(addresses[i].second) {
-            TravelFile(oldFile, newFile);
+        *progress += 0.9f * share / files;
+    }
 
-            *progress += 0.9f / len;
-        }
+    WriteDirectory(writer, TakeStream(namesWriter, namesStream), rewrite.entries);
+    writer.Finish();
 
-    int fileNumber = 0;
-    while(fileNumber < INT_MAX && FileExists(filesystem::temp_directory_path().string() + "tempFile_" + to_string(fileNumber) + ".txt"))
-        fileNumber++;
-    tempFileName = filesystem::temp_directory_path().string() + "tempFile_" + to_string(fileNumber) + ".txt";
+    oldFile.close();
+    newFile.close();
 
-    for(const auto &i : addresses_newFile)
-        if(!is_directory(i)) {
-            progress_ratio = 0.9f / len;
+    //the old archive is kept until the new one is whole, a failed write puts it back
+    if(archive_corrupted || !newFile) {
+        archive_corrupted = true;
+        remove(compressedFile.c_str());
+        rename(oldFileAddress.c_str(), compressedFile.c_str());
+        return;
+    }
 
-            Compress_help(i, newFile);
-        }
+    remove(oldFileAddress.c_str());
+}
 
-    for(int i = index; i < addresses.size(); i++)
-        if(addresses[i].second) {
-            TravelFile(oldFile, newFile);
+void CompactArchive(const string &compressedFile, float &prog) {
+    archive_corrupted = false;
+    prog = 0;
+    progress = &prog;
 
-            *progress += 0.9f / len;
-        }
+    CompactArchive_help(compressedFile, 1.0f);
 
     *progress = 1;
+}
 
-    //Write what is left
-    writeBuffer[writeBufferIndex] <<= (8 - byteIndex);
-    newFile.write(reinterpret_cast<char*>(writeBuffer), writeBufferIndex + 1);
+//an edit compacts an archive on its own once the dead space is a large part of it
+bool NeedsCompaction(const uint64_t &archiveSize) {
+    const uint64_t deadSpace = archiveDirectory.DeadSpace();
+    return deadSpace >= COMPACT_MIN_DEAD_SPACE && deadSpace > archiveSize * COMPACT_DEAD_SHARE;
+}
 
-    oldFile.close();
-    newFile.close();
+//ends an archive with a directory that is edited in place with new names and a new directory after what writer has,
+//the ones it had become dead space; archiveDirectory gets the new directory
+void AppendDirectory(BitWriter &writer, const CompressedStream &names, vector<DirectoryEntry> &entries) {
+    writer.Align();
+    archiveDirectory.offset = writer.Position() / 8;
+    WriteDirectory(writer, names, entries);
+    writer.Finish();
 
-    remove(tempFileName.c_str());
-    remove((filesystem::temp_directory_path().string() + compressedFileName + "_" + to_string(temp_file_idx) + ".txt").c_str());
+    archiveDirectory.entries = move(entries);
 }
 
-void TravelFile(ifstream &file) {
+
+//an archive with a directory gets the new files after everything it has and a new directory after them, so nothing
+//it had is written again; the old directory is left as dead space, which compaction gives back
+//returns false when the archive has no directory and has to be written again
+bool AppendFile(const string &fileToCompress, const string &compressedFile, const int &index, const CompressionLevel &config) {
+    fstream file(compressedFile, ios::binary | ios::in | ios::out);
+    if(!file)
+        return false;
+
+    BitReader reader(file);
+    vector<pair<string, bool>> addresses = GetCompressedFilesWithFile(reader);
+
     if(archive_corrupted)
-        return;
-    
-    unsigned char byte;
-    string binary = bytesFromTheLastRead;
-    int binaryLength = static_cast<int>(binary.length()), binaryPos = 0;
+        return true;
+    if(archiveHeader.version < DIRECTORY_VERSION)
+        return false;
 
-//------------------------------------------------ LENGTH -------------------------------------
+    ostringstream namesStream;
+    BitWriter namesWriter(namesStream);
+    vector<string> addresses_newFile;
+    size_t firstEntry = 0; //the entry of the first new file
 
-    if(binaryPos + 9 >= binaryLength)
-        ReadDataToDecompress(binary, file, binaryLength, binaryPos);
+    for(size_t i = 0; i < addresses.size(); i++) {
+        if(i == static_cast<size_t>(index))
+            CompressNames(fileToCompress, namesWriter, addresses_newFile);
+        if(i < static_cast<size_t>(index))
+            firstEntry += addresses[i].second;
 
-    if(binaryPos + 9 > binaryLength) {
-        archive_corrupted = true;
-        return;
+        if(addresses[i].first != "")
+            CompressFileName(addresses[i].first, namesWriter, addresses[i].second);
+        else
+            namesWriter.Put(0, 8);
     }
 
-    int codesSize = 0;
-    for (int i = 0; i < 9; i++) {
-        codesSize <<= 1;
-        if (binary[binaryPos + i] == '1')
-            codesSize |= 1;
+    namesWriter.Put(0, 8);
+
+    *progress = 0.1f;
+
+    int len = 0;
+    for(auto i : addresses_newFile)
+        if(!is_directory(i))
+            len++;
+    progress_ratio = 0.9f / max(len, 1);
+
+    const uint64_t oldSize = reader.StreamSize();
+    file.clear();
+    file.seekp(0, ios::end);
+    BitWriter writer(file, oldSize);
+
+    vector<DirectoryEntry> added;
+    CompressFiles(addresses_newFile, writer, config, added);
+
+    vector<DirectoryEntry> entries = archiveDirectory.entries;
+    entries.insert(entries.begin() + firstEntry, added.begin(), added.end());
+    AppendDirectory(writer, TakeStream(namesWriter, namesStream), entries);
+
+    const bool written = file.good();
+    file.close();
+
+    //a failed append leaves the archive as it was
+    if(archive_corrupted || !written) {
+        archive_corrupted = true;
+        error_code error;
+        filesystem::resize_file(compressedFile, oldSize, error);
+        return true;
     }
-    binaryPos += 9;
 
-    vector<pair<int, int>> codeLength(codesSize);
-    int codeLengthIdx = 0;
+    if(NeedsCompaction(writer.Position() / 8))
+        CompactArchive_help(compressedFile, 1 - *progress);
+
+    *progress = 1;
+
+    return true;
+}
+
+void InsertFile(const string &fileToCompress, const string &compressedFile, const int &index, float &prog, int level) {
+    archive_corrupted = false;
+    prog = 0;
+    progress = &prog;
 
+    const CompressionLevel &config = COMPRESSION_LEVELS[clamp(level, MIN_COMPRESSION_LEVEL, MAX_COMPRESSION_LEVEL)];
+    if(AppendFile(fileToCompress, compressedFile, index, config))
+        return;
 
-    if(binaryPos + codesSize * 14 >= binaryLength)
-        ReadDataToDecompress(binary, file, binaryLength, binaryPos);
+    const string oldFileAddress = OldArchiveAddress(compressedFile);
 
-    if(binaryPos + codesSize * 14 > binaryLength) {
+    rename(compressedFile.c_str(), oldFileAddress.c_str());
+    ifstream oldFile(oldFileAddress, ios::binary);
+    if(!oldFile) {
         archive_corrupted = true;
         return;
     }
+    BitReader oldReader(oldFile);
+    vector<pair<string, bool>> addresses = GetCompressedFilesWithFile(oldReader);
 
-    while(codesSize--) {
-        int symbol = 0, symbolLength = 0;
-        for(int i = 0; i < 9; i++) {
-            symbol <<= 1;
-            if(binary[i + binaryPos] == '1')
-                symbol |= 1;
-        }
-        for(int i = 9; i < 14; i++) {
-            symbolLength <<= 1;
-            if(binary[i + binaryPos] == '1')
-                symbolLength |= 1;
-        }
-        binaryPos += 14;
+    if(archive_corrupted)
+        return;
 
-        codeLength[codeLengthIdx++] = {symbolLength, symbol};
+    ofstream newFile(compressedFile, ios::binary);
+    if(!newFile) {
+        archive_corrupted = true;
+        oldFile.close();
+        remove(oldFileAddress.c_str());
+        return;
     }
+    BitWriter writer(newFile);
+    WriteArchiveHeader(writer, archiveHeader);
 
-    sort(codeLength.begin(), codeLength.end());
-    unordered_map<string, int> reverseCodes;
-    reverseCodes.reserve(codesSize);
-    ReverseCode(codeLength, reverseCodes);
-
-//------------------------------------------------ OFFSET -------------------------------------
+    //an archive with a directory keeps the names in it, after the files
+    const bool directory = archiveHeader.version >= DIRECTORY_VERSION;
+    ostringstream namesStream;
+    BitWriter namesWriter(namesStream);
+    BitWriter &nameWriter = directory ? namesWriter : writer;
+    ArchiveRewrite rewrite = StartRewrite(oldFileAddress, compressedFile);
 
-    if(binaryPos + 5 >= binaryLength)
-        ReadDataToDecompress(binary, file, binaryLength, binaryPos);
+    string folderPath = "";
+    int real_index = 0;
+    vector<string> addresses_newFile;
 
-    if(binaryPos + 5 > binaryLength) {
-        archive_corrupted = true;
-        return;
-    }
-    
-    codesSize = 0;
-    for (int i = 0; i < 5; i++) {
-        codesSize <<= 1;
-        if (binary[i + binaryPos] == '1')
-            codesSize |= 1;
+    for(int i = 0; i < addresses.size(); i++) {
+        if(i == index)
+            CompressNames(fileToCompress, nameWriter, addresses_newFile);
+        
+        if(addresses[i].first != "") {
+            CompressFileName(addresses[i].first, nameWriter, addresses[i].second);
+            real_index++;
+        }
+        else
+            nameWriter.Put(0, 8);
     }
-    binaryPos += 5;
 
-    vector<pair<int, int>> offsetCodes(codesSize);
-    int offsetCodesIdx = 0;
+    nameWriter.Put(0, 8);
 
-    if(binaryPos + codesSize * 9 >= binaryLength)
-        ReadDataToDecompress(binary, file, binaryLength, binaryPos);
+    *progress = 0.1f;
+    
+    int len = 0;
+    for(auto i : addresses)
+        len += i.second;
+    for(auto i : addresses_newFile)
+        if(!is_directory(i))
+            len++;
 
-    if(binaryPos + codesSize * 9 > binaryLength) {
-        archive_corrupted = true;
-        return;
-    }
+    for(int i = 0; i < index; i++)
+        if(addresses[i].second) {
+            TravelFile(oldReader, &writer, rewrite);
 
-    while(codesSize--) {
-        int symbol = 0, symbolLength = 0;
-        for(int i = 0; i < 5; i++) {
-            symbol <<= 1;
-            if(binary[i + binaryPos] == '1')
-                symbol |= 1;
-        }
-        for(int i = 5; i < 9; i++) {
-            symbolLength <<= 1;
-            if(binary[i + binaryPos] == '1')
-                symbolLength |= 1;
+            *progress += 0.9f / len;
         }
-        binaryPos += 9;
-
-        offsetCodes[offsetCodesIdx++] = {symbolLength, symbol};
-    }
 
-    sort(offsetCodes.begin(), offsetCodes.end());
-    unordered_map<string, int> reverseOffsetCodes;
-    reverseOffsetCodes.reserve(codesSize);
-    ReverseCode(offsetCodes, reverseOffsetCodes);
+    progress_ratio = 0.9f / len;
+    CompressFiles(addresses_newFile, writer, config, rewrite.entries);
 
-//------------------------------------------------- READ FILE -----------------------------------------------------------------
+    for(int i = index; i < addresses.size(); i++)
+        if(addresses[i].second) {
+            TravelFile(oldReader, &writer, rewrite);
 
-    unsigned char decompressedBytes[WINDOW_SIZE * 2];
-    int decompressedBytesIdx = 0;
-    auto getExtraBytes = [](int sizeLength, int &binaryPos, string &binary, string &value) {
-        if(binaryPos + sizeLength > static_cast<int>(binary.length())) {
-            archive_corrupted = true;
-            return;
+            *progress += 0.9f / len;
         }
-        while(sizeLength--)
-            value += binary[binaryPos++];
-    };
 
-    LZ77 token;
-    bool readOffset = false;
-    bool end_of_block = false;
-    string value = "";
-    int pos = 0;
-
-    while(!end_of_block && !archive_corrupted) {
-        if(binaryPos + 14 >= binaryLength)
-            ReadDataToDecompress(binary, file, binaryLength, binaryPos);
-        if(binaryPos > binaryLength) {
-            cout << "ERROR - No data: " << binaryPos << ' ' << binaryLength << ' ' << binary.length() << endl;
-            archive_corrupted = true;
-            return;
-        }
-        value += binary[binaryPos++];
+    *progress = 1;
 
-        if(readOffset) {
-            auto it = reverseOffsetCodes.find(value);
-            if(it != reverseOffsetCodes.end()) {
-                int nr = it -> second;
-                if(nr <= 3)
-                    token.offset = nr + 1;
-                else if(nr <= 5) {
-                    getExtraBytes(1, binaryPos, binary, value);
-                }
-                else if(nr <= 7) {
-                    getExtraBytes(2, binaryPos, binary, value);
-                }
-                else if(nr <= 9) {
-                    getExtraBytes(3, binaryPos, binary, value);
-                }
-                else if(nr <= 11) {
-                    getExtraBytes(4, binaryPos, binary, value);
-                }
-                else if(nr <= 13) {
-                    getExtraBytes(5, binaryPos, binary, value);
-                }
-                else if(nr <= 15) {
-                    getExtraBytes(6, binaryPos, binary, value);
-                }
-                else if(nr <= 17) {
-                    getExtraBytes(7, binaryPos, binary, value);
-                }
-                else if(nr <= 19) {
-                    getExtraBytes(8, binaryPos, binary, value);
-                }
-                else if(nr <= 21) {
-                    getExtraBytes(9, binaryPos, binary, value);
-                }
-                else if(nr <= 23) {
-                    getExtraBytes(10, binaryPos, binary, value);
-                }
-                else if(nr <= 25) {
-                    getExtraBytes(11, binaryPos, binary, value);
-                }
-                else if(nr <= 27) {
-                    getExtraBytes(12, binaryPos, binary, value);
-                }
-                else if(nr <= 29) {
-                    getExtraBytes(13, binaryPos, binary, value);
-                }
-                else {
-                    cerr << "Error at decompressing the offset of the code" << endl;
-                    archive_corrupted = true;
-                    return;
-                }
+    if(directory)
+        WriteDirectory(writer, TakeStream(namesWriter, namesStream), rewrite.entries);
 
-                value = "";
+    //Write what is left
+    writer.Finish();
 
-                readOffset = false;
-            }
-        }
-        else {
-            auto it = reverseCodes.find(value);
-            if(it != reverseCodes.end()) {
-                if(it -> second < 256) {
-                    value = "";
-                }
-                else if(it -> second == 256) {
-                    bytesFromTheLastRead = binary.substr(binaryPos);
-                    end_of_block = true;
+    oldFile.close();
+    newFile.close();
 
-                    break;
-                }
-                else {
-                    int nr = it -> second;
-                    if(nr <= 264)
-                        nr = nr - 257 + 3;
-                    else if(nr <= 268) {
-                        getExtraBytes(1, binaryPos, binary, value);
-                    }
-                    else if(nr <= 272) {
-                        getExtraBytes(2, binaryPos, binary, value);
-                    }
-                    else if(nr <= 276) {
-                        getExtraBytes(3, binaryPos, binary, value);
-                    }
-                    else if(nr <= 280) {
-                        getExtraBytes(4, binaryPos, binary, value);
-                    }
-                    else if(nr <= 284) {
-                        getExtraBytes(5, binaryPos, binary, value);
-                    }
-                    else if(nr == 285)
-                        nr = 258;
-                    else {
-                        cout << "Error at decompressing the length of the token" << endl;
-                        archive_corrupted = true;
-                        return;
-                    }
-                    
-                    readOffset = true;
-                    value = "";
-                }
-            }
-        }
-    }
+    remove(oldFileAddress.c_str());
 }
 
 void Decompress(const string &toDecompressFolderAddress, const string &compressedFileAddress, float &prog)
@@ -1880,10 +2499,6 @@ void Decompress(const string &toDecompressFolderAddress, const string &compresse
 
 void Decompress(const string &toDecompressFolderAddress, const string &compressedFileAddress, vector<int> indices)
 {
-    bytesFromTheLastRead = "";
-    writeBufferIndex = 0;
-    byteIndex = 0;
-
     sort(indices.begin(), indices.end());
 
     ifstream file(compressedFileAddress, ios::binary);
@@ -1892,9 +2507,16 @@ void Decompress(const string &toDecompressFolderAddress, const string &compresse
         return;
     }
 
-    string binary = "";
-    int binaryLength = static_cast<int>(binary.length()), binaryPos = 0;
-    vector<pair<string, bool>> addresses = GetCompressedFilesWithFile(file);
+    BitReader reader(file);
+    vector<pair<string, bool>> addresses = GetCompressedFilesWithFile(reader);
+    if(archive_corrupted)
+        return;
+
+    //with a directory the files are found through their entries, without going through the ones before them
+    const bool directory = archiveHeader.version >= DIRECTORY_VERSION;
+    vector<int> entryOf(addresses.size() + 1, 0);
+    for(size_t i = 0; i < addresses.size(); i++)
+        entryOf[i + 1] = entryOf[i] + addresses[i].second;
 
     int len = 0;
     for(int i = 0; i < indices.back(); i++)
@@ -1904,12 +2526,14 @@ void Decompress(const string &toDecompressFolderAddress, const string &compresse
     for(auto index : indices) {
         for(int i = lastIndex; i < index; i++)
             if(addresses[i].second && addresses[i].first != "") {
-                TravelFile(file);
+                if(!directory)
+                    TravelFile(reader);
 
                 *progress += 0.4f / len;
             }
 
         vector<pair<string, bool>> to_decompress_addresses;
+        vector<int> to_decompress_indices;
         for(int i = (int) addresses[index].first.length() - 1; i >= 0; i--)
             if(addresses[index].first[i] == '/') {
                 addresses[index].first = addresses[index].first.substr(i + 1);
@@ -1917,6 +2541,7 @@ void Decompress(const string &toDecompressFolderAddress, const string &compresse
             }
         
         to_decompress_addresses.push_back({toDecompressFolderAddress + "\\" + addresses[index].first, addresses[index].second});
+        to_decompress_indices.push_back(index);
         int i = index + 1, folders = !addresses[index].second;
 
         while(folders > 0) {
@@ -1931,6 +2556,7 @@ void Decompress(const string &toDecompressFolderAddress, const string &compresse
                     }
             
             to_decompress_addresses.push_back({toDecompressFolderAddress + "\\" + addresses[i].first, addresses[i].second});
+            to_decompress_indices.push_back(i);
 
             if(addresses[i].first == "")
                 folders--;
@@ -1939,19 +2565,20 @@ void Decompress(const string &toDecompressFolderAddress, const string &compresse
             i++;
         }
 
-        if(to_decompress_addresses.size() > 1)
+        if(to_decompress_addresses.size() > 1) {
             to_decompress_addresses.pop_back(); //to remove the last end_of_folder
+            to_decompress_indices.pop_back();
+        }
         
-        for(auto idx : to_decompress_addresses)
+        for(size_t j = 0; j < to_decompress_addresses.size(); j++) {
+            const auto &idx = to_decompress_addresses[j];
             if(idx.first != "") {
-                writeBufferIndex = 0;
-                byteIndex = 0;
-
-                DecompressFile(idx.first, idx.second, file);
+                DecompressFile(idx.first, idx.second, reader, directory && idx.second ? &archiveDirectory.entries[entryOf[to_decompress_indices[j]]] : nullptr);
 
                 *progress += 0.6f / (static_cast<float>(indices.size()) * static_cast<float>(to_decompress_addresses.size()));
             }
-        
+        }
+
         lastIndex = i;
     }
 }
@@ -1967,40 +2594,123 @@ void Decompress(const string &toDecompressFolderAddress, const string &compresse
     prog = 1;
 }
 
+//deleting from an archive with a directory only appends names and a directory without the deleted files, their streams
+//are left where they are as dead space, which compaction gives back
+//returns false when the archive has no directory and has to be written again
+bool DeleteEntries(const string &compressedFile, const vector<int> &indices) {
+    fstream file(compressedFile, ios::binary | ios::in | ios::out);
+    if(!file)
+        return false;
+
+    BitReader reader(file);
+    vector<pair<string, bool>> addresses = GetCompressedFilesWithFile(reader);
+
+    if(archive_corrupted)
+        return true;
+    if(archiveHeader.version < DIRECTORY_VERSION)
+        return false;
+
+    //a deleted folder takes everything up to its end with it
+    vector<bool> deleted(addresses.size(), false);
+    for(auto k : indices) {
+        if(k < 0 || k >= static_cast<int>(addresses.size()))
+            continue;
+
+        deleted[k] = true;
+        int f = !addresses[k].second;
+        for(size_t i = k + 1; f > 0 && i < addresses.size(); i++) {
+            deleted[i] = true;
+            if(addresses[i].first == "")
+                f--;
+            else if(!addresses[i].second)
+                f++;
+        }
+    }
+
+    ostringstream namesStream;
+    BitWriter namesWriter(namesStream);
+    vector<DirectoryEntry> entries;
+    size_t entry = 0;
+
+    for(size_t i = 0; i < addresses.size(); i++) {
+        if(addresses[i].second && !deleted[i])
+            entries.push_back(archiveDirectory.entries[entry]);
+        entry += addresses[i].second;
+
+        if(deleted[i])
+            continue;
+
+        if(addresses[i].first != "")
+            CompressFileName(addresses[i].first, namesWriter, addresses[i].second);
+        else
+            namesWriter.Put(0, 8);
+    }
+
+    namesWriter.Put(0, 8);
+
+    *progress = 0.5f;
+
+    const uint64_t oldSize = reader.StreamSize();
+    file.clear();
+    file.seekp(0, ios::end);
+    BitWriter writer(file, oldSize);
+    AppendDirectory(writer, TakeStream(namesWriter, namesStream), entries);
+
+    const bool written = file.good();
+    file.close();
+
+    if(!written) {
+        archive_corrupted = true;
+        error_code error;
+        filesystem::resize_file(compressedFile, oldSize, error);
+        return true;
+    }
+
+    if(NeedsCompaction(writer.Position() / 8))
+        CompactArchive_help(compressedFile, 1 - *progress);
+
+    return true;
+}
+
 void DeleteFiles(const string &compressedFile, vector<int> indices, float &prog) {
     archive_corrupted = false;
     prog = 0;
     progress = &prog;
 
-    int temp_file_idx = 0;
-    writeBufferIndex = 0;
-    byteIndex = 0;
-    bytesFromTheLastRead = "";
-    string compressedFileName = "";
+    if(DeleteEntries(compressedFile, indices)) {
+        *progress = 1.0f;
+        return;
+    }
 
     sort(indices.begin(), indices.end());
 
-    for(int i = static_cast<int>(compressedFile.length()) - 1; i >= 0 && compressedFile[i] != '\\' && compressedFile[i] != '/'; i--)
-        compressedFileName += compressedFile[i];
-    reverse(compressedFileName.begin(), compressedFileName.end());
-
-    while(temp_file_idx < INT_MAX && FileExists(filesystem::temp_directory_path().string() + compressedFileName + "_" + to_string(temp_file_idx) + ".txt"))
-        temp_file_idx++;
+    const string oldFileAddress = OldArchiveAddress(compressedFile);
 
-    rename(compressedFile.c_str(), (filesystem::temp_directory_path().string() + compressedFileName + "_" + to_string(temp_file_idx) + ".txt").c_str());
-    ifstream oldFile(filesystem::temp_directory_path().string() + compressedFileName + "_" + to_string(temp_file_idx) + ".txt", ios::binary);
+    rename(compressedFile.c_str(), oldFileAddress.c_str());
+    ifstream oldFile(oldFileAddress, ios::binary);
     if(!oldFile) {
         archive_corrupted = true;
         return;
     }
-    vector<pair<string, bool>> addresses = GetCompressedFilesWithFile(oldFile);
+    BitReader oldReader(oldFile);
+    vector<pair<string, bool>> addresses = GetCompressedFilesWithFile(oldReader);
 
     ofstream newFile(compressedFile, ios::binary);
     if(!newFile) {
         archive_corrupted = true;
         oldFile.close();
-        remove((filesystem::temp_directory_path().string() + compressedFileName + "_" + to_string(temp_file_idx) + ".txt").c_str());
+        remove(oldFileAddress.c_str());
     }
+    BitWriter writer(newFile);
+    WriteArchiveHeader(writer, archiveHeader);
+
+    //an archive with a directory keeps the names in it, after the files
+    const bool directory = archiveHeader.version >= DIRECTORY_VERSION;
+    ostringstream namesStream;
+    BitWriter namesWriter(namesStream);
+    BitWriter &nameWriter = directory ? namesWriter : writer;
+    ArchiveRewrite rewrite = StartRewrite(oldFileAddress, compressedFile);
+
     string folderPath = "";
     int real_index = 0;
     vector<string> addresses_newFile;
@@ -2030,14 +2740,14 @@ void DeleteFiles(const string &compressedFile, vector<int> indices, float &prog)
         }
         
         if(addresses[i].first != "") {
-            CompressFileName(addresses[i].first, newFile, addresses[i].second);
+            CompressFileName(addresses[i].first, nameWriter, addresses[i].second);
         }
         else {
-            WriteToBuffer(newFile, 0);
+            nameWriter.Put(0, 8);
         }
     }
 
-    WriteToBuffer(newFile, 0);
+    nameWriter.Put(0, 8);
 
     int len = 0;
     for(auto i : addresses)
@@ -2047,13 +2757,13 @@ void DeleteFiles(const string &compressedFile, vector<int> indices, float &prog)
     for(auto k : indices) {
         for(int i = last_index; i < k; i++)
             if(addresses[i].second) {
-                TravelFile(oldFile, newFile);
+                TravelFile(oldReader, &writer, rewrite);
 
                 *progress += 1.0 / len;
             }
 
         if(addresses[k].second) {
-            TravelFile(oldFile);
+            TravelFile(oldReader, nullptr, rewrite);
             last_index = k + 1;
 
             *progress += 1.0 / len;
@@ -2068,7 +2778,7 @@ void DeleteFiles(const string &compressedFile, vector<int> indices, float &prog)
                     if(addresses[last_index].second == 0)
                         f++;
                     else {
-                        TravelFile(oldFile);
+                        TravelFile(oldReader, nullptr, rewrite);
 
                         *progress += 1.0 / len;
                     }
@@ -2080,298 +2790,25 @@ void DeleteFiles(const string &compressedFile, vector<int> indices, float &prog)
 
     for(int i = last_index; i < addresses.size(); i++)
             if(addresses[i].second == 1) {
-                TravelFile(oldFile, newFile);
+                TravelFile(oldReader, &writer, rewrite);
 
                 *progress += 1.0 / len;
             }
 
+    if(directory)
+        WriteDirectory(writer, TakeStream(namesWriter, namesStream), rewrite.entries);
+
     //Write what is left
-    if(byteIndex > 0)
-        writeBuffer[writeBufferIndex] <<= (8 - byteIndex);
-    newFile.write(reinterpret_cast<char*>(writeBuffer), writeBufferIndex + (byteIndex > 0));
+    writer.Finish();
 
     oldFile.close();
     newFile.close();
 
-    remove(tempFileName.c_str());
-    remove((filesystem::temp_directory_path().string() + compressedFileName + "_" + to_string(temp_file_idx) + ".txt").c_str());
+    remove(oldFileAddress.c_str());
 
     *progress = 1.0f;
 }
 
-void TravelFileToMove(ifstream &file, ofstream &outFile, string &saveBytes) {
-    unsigned char byte;
-    string binary = saveBytes;
-    int binaryLength = static_cast<int>(binary.length()), binaryPos = 0;
-
-//------------------------------------------------ LENGTH -------------------------------------
-
-    if(binaryPos + 9 >= binaryLength)
-        ReadDataToDecompress(binary, file, binaryLength, binaryPos);
-
-    int codesSize = 0;
-    for (int i = 0; i < 9; i++) {
-        codesSize <<= 1;
-        if (binary[binaryPos + i] == '1')
-            codesSize |= 1;
-    }
-    binaryPos += 9;
-    WriteToBufferBig(outFile, codesSize, 9);
-
-    vector<pair<int, int>> codeLength(codesSize);
-    int codeLengthIdx = 0;
-
-
-    if(binaryPos + codesSize * 14 >= binaryLength)
-        ReadDataToDecompress(binary, file, binaryLength, binaryPos);
-
-    while(codesSize--) {
-        int symbol = 0, symbolLength = 0;
-        for(int i = 0; i < 9; i++) {
-            symbol <<= 1;
-            if(binary[i + binaryPos] == '1')
-                symbol |= 1;
-        }
-        WriteToBufferBig(outFile, symbol, 9);
-        for(int i = 9; i < 14; i++) {
-            symbolLength <<= 1;
-            if(binary[i + binaryPos] == '1')
-                symbolLength |= 1;
-        }
-        WriteToBuffer(outFile, symbolLength, 5);
-        binaryPos += 14;
-
-        codeLength[codeLengthIdx++] = {symbolLength, symbol};
-    }
-
-    sort(codeLength.begin(), codeLength.end());
-    unordered_map<string, int> reverseCodes;
-    reverseCodes.reserve(codesSize);
-    ReverseCode(codeLength, reverseCodes);
-
-//------------------------------------------------ OFFSET -------------------------------------
-
-    if(binaryPos + 5 >= binaryLength)
-        ReadDataToDecompress(binary, file, binaryLength, binaryPos);
-    
-    codesSize = 0;
-    for (int i = 0; i < 5; i++) {
-        codesSize <<= 1;
-        if (binary[i + binaryPos] == '1')
-            codesSize |= 1;
-    }
-    WriteToBuffer(outFile, codesSize, 5);
-    binaryPos += 5;
-
-    vector<pair<int, int>> offsetCodes(codesSize);
-    int offsetCodesIdx = 0;
-
-    if(binaryPos + codesSize * 9 >= binaryLength)
-        ReadDataToDecompress(binary, file, binaryLength, binaryPos);
-
-    while(codesSize--) {
-        int symbol = 0, symbolLength = 0;
-        for(int i = 0; i < 5; i++) {
-            symbol <<= 1;
-            if(binary[i + binaryPos] == '1')
-                symbol |= 1;
-        }
-        WriteToBuffer(outFile, symbol, 5);
-        for(int i = 5; i < 9; i++) {
-            symbolLength <<= 1;
-            if(binary[i + binaryPos] == '1')
-                symbolLength |= 1;
-        }
-        WriteToBuffer(outFile, symbolLength, 4);
-        binaryPos += 9;
-
-        offsetCodes[offsetCodesIdx++] = {symbolLength, symbol};
-    }
-
-    sort(offsetCodes.begin(), offsetCodes.end());
-    unordered_map<string, int> reverseOffsetCodes;
-    reverseOffsetCodes.reserve(codesSize);
-    ReverseCode(offsetCodes, reverseOffsetCodes);
-
-//------------------------------------------------- READ FILE -----------------------------------------------------------------
-
-    unsigned char decompressedBytes[WINDOW_SIZE * 2];
-    int decompressedBytesIdx = 0;
-    auto getExtraBytes = [](int sizeLength, int &binaryPos, string &binary, string &value) {
-        while(sizeLength--)
-            value += binary[binaryPos++];
-    };
-
-    LZ77 token;
-    bool readOffset = false;
-    bool end_of_block = false;
-    string value = "";
-    int pos = 0;
-
-    while(!end_of_block) {
-        if(binaryPos + 14 >= binaryLength)
-            ReadDataToDecompress(binary, file, binaryLength, binaryPos);
-        if(binaryPos + 1 >= binary.length()) {
-            cout << "ERROR - No data: " << binaryPos << ' ' << binaryLength << ' ' << binary.length() << endl;
-        }
-        value += binary[binaryPos++];
-
-        if(readOffset) {
-            auto it = reverseOffsetCodes.find(value);
-            if(it != reverseOffsetCodes.end()) {
-                int nr = it -> second;
-                if(nr <= 3)
-                    token.offset = nr + 1;
-                else if(nr <= 5) {
-                    getExtraBytes(1, binaryPos, binary, value);
-                }
-                else if(nr <= 7) {
-                    getExtraBytes(2, binaryPos, binary, value);
-                }
-                else if(nr <= 9) {
-                    getExtraBytes(3, binaryPos, binary, value);
-                }
-                else if(nr <= 11) {
-                    getExtraBytes(4, binaryPos, binary, value);
-                }
-                else if(nr <= 13) {
-                    getExtraBytes(5, binaryPos, binary, value);
-                }
-                else if(nr <= 15) {
-                    getExtraBytes(6, binaryPos, binary, value);
-                }
-                else if(nr <= 17) {
-                    getExtraBytes(7, binaryPos, binary, value);
-                }
-                else if(nr <= 19) {
-                    getExtraBytes(8, binaryPos, binary, value);
-                }
-                else if(nr <= 21) {
-                    getExtraBytes(9, binaryPos, binary, value);
-                }
-                else if(nr <= 23) {
-                    getExtraBytes(10, binaryPos, binary, value);
-                }
-                else if(nr <= 25) {
-                    getExtraBytes(11, binaryPos, binary, value);
-                }
-                else if(nr <= 27) {
-                    getExtraBytes(12, binaryPos, binary, value);
-                }
-                else if(nr <= 29) {
-                    getExtraBytes(13, binaryPos, binary, value);
-                }
-                else {
-                    cerr << "Error at decompressing the offset of the code" << endl;
-                    exit(1);
-                }
-
-                unsigned char tempByte = 0, tempByteIdx = 0;
-
-                for(char c : value) {
-                    tempByte = (tempByte << 1) + (c == '1');
-                    tempByteIdx++;
-
-                    if(tempByteIdx == 8) {
-                        WriteToBuffer(outFile, tempByte);
-
-                        tempByteIdx = 0;
-                        tempByte = 0;
-                    }
-                }
-
-                if(tempByteIdx > 0) {
-                    WriteToBuffer(outFile, tempByte, tempByteIdx);
-                }
-
-                value = "";
-
-                readOffset = false;
-            }
-        }
-        else {
-            auto it = reverseCodes.find(value);
-            if(it != reverseCodes.end()) {
-                if(it -> second <= 256) {
-                    unsigned char tempByte = 0, tempByteIdx = 0;
-
-                    for(char c : value) {
-                        tempByte = (tempByte << 1) + (c == '1');
-                        tempByteIdx++;
-
-                        if(tempByteIdx == 8) {
-                            WriteToBuffer(outFile, tempByte);
-
-                            tempByteIdx = 0;
-                            tempByte = 0;
-                        }
-                    }
-                    if(tempByteIdx > 0) {
-                        WriteToBuffer(outFile, tempByte, tempByteIdx);
-                    }
-                }
-
-                if(it -> second < 256) {
-                    value = "";
-                }
-                else if(it -> second == 256) {
-                    saveBytes = binary.substr(binaryPos);
-                    end_of_block = true;
-
-                    break;
-                }
-                else {
-                    int nr = it -> second;
-                    if(nr <= 264)
-                        nr = nr - 257 + 3;
-                    else if(nr <= 268) {
-                        getExtraBytes(1, binaryPos, binary, value);
-                    }
-                    else if(nr <= 272) {
-                        getExtraBytes(2, binaryPos, binary, value);
-                    }
-                    else if(nr <= 276) {
-                        getExtraBytes(3, binaryPos, binary, value);
-                    }
-                    else if(nr <= 280) {
-                        getExtraBytes(4, binaryPos, binary, value);
-                    }
-                    else if(nr <= 284) {
-                        getExtraBytes(5, binaryPos, binary, value);
-                    }
-                    else if(nr == 285)
-                        nr = 258;
-                    else {
-                        cout << "Error at decompressing the length of the token" << endl;
-                        exit(1);
-                    }
-
-                    unsigned char tempByte = 0, tempByteIdx = 0;
-
-                    for(char c : value) {
-                        tempByte = (tempByte << 1) + (c == '1');
-                        tempByteIdx++;
-
-                        if(tempByteIdx == 8) {
-                            WriteToBuffer(outFile, tempByte);
-
-                            tempByteIdx = 0;
-                            tempByte = 0;
-                        }
-                    }
-
-                    if(tempByteIdx > 0) {
-                        WriteToBuffer(outFile, tempByte, tempByteIdx);
-                    }
-                    
-                    readOffset = true;
-                    value = "";
-                }
-            }
-        }
-    }
-}
-
 void MoveFiles(const string &compressedFile, vector<int> indices, const int &index, float &prog) {
     archive_corrupted = false;
     
@@ -2384,9 +2821,6 @@ void MoveFiles(const string &compressedFile, vector<int> indices, const int &ind
     
     sort(indices.begin(), indices.end());
     string compressedFileName = "";
-    writeBufferIndex = 0;
-    byteIndex = 0;
-    bytesFromTheLastRead = "";
 
     for(int i = static_cast<int>(compressedFile.length()) - 1; i >= 0 && compressedFile[i] != '\\' && compressedFile[i] != '/'; i--)
         compressedFileName += compressedFile[i];
@@ -2401,6 +2835,7 @@ void MoveFiles(const string &compressedFile, vector<int> indices, const int &ind
         archive_corrupted = true;
         return;
     }
+    BitWriter tempWriter(tempFile);
     ifstream file(compressedFile, ios::binary);
     if(!file) {
         archive_corrupted = true;
@@ -2409,9 +2844,15 @@ void MoveFiles(const string &compressedFile, vector<int> indices, const int &ind
         return;
     }
 
-    vector<pair<string, bool>> addresses = GetCompressedFilesWithFile(file);
+    BitReader reader(file);
+    vector<pair<string, bool>> addresses = GetCompressedFilesWithFile(reader);
     vector<pair<string, bool>> filesToMove;
 
+    //an archive with a directory copies the moved files straight from their entries, the temporary file stays empty
+    const bool directory = archiveHeader.version >= DIRECTORY_VERSION;
+    vector<size_t> movedEntries;
+    ArchiveRewrite rewrite;
+
     int len = 0;
     for(auto i : addresses)
         len += i.second;
@@ -2420,7 +2861,7 @@ void MoveFiles(const string &compressedFile, vector<int> indices, const int &ind
     for(auto i : indices) {
         while(last < i) {
             if(addresses[last].second) {
-                TravelFile(file);
+                TravelFile(reader, nullptr, rewrite);
 
                 *progress += 0.45f / len;
             }
@@ -2428,7 +2869,8 @@ void MoveFiles(const string &compressedFile, vector<int> indices, const int &ind
         }
         filesToMove.push_back(addresses[i]);
         if(filesToMove.back().second) {
-            TravelFile(file, tempFile);
+            movedEntries.push_back(rewrite.next);
+            TravelFile(reader, directory ? nullptr : &tempWriter, rewrite);
 
             *progress += 0.45f / len;
         }
@@ -2439,7 +2881,8 @@ void MoveFiles(const string &compressedFile, vector<int> indices, const int &ind
         while(f > 0) {
             filesToMove.push_back(addresses[i]);
             if(filesToMove.back().second) {
-                TravelFile(file, tempFile);
+                movedEntries.push_back(rewrite.next);
+            TravelFile(reader, directory ? nullptr : &tempWriter, rewrite);
 
                 *progress += 0.45f / len;
             }
@@ -2455,24 +2898,16 @@ void MoveFiles(const string &compressedFile, vector<int> indices, const int &ind
 
     *progress = 0.45f;
 
-    if(byteIndex > 0)
-        writeBuffer[writeBufferIndex] <<= (8 - byteIndex);
-    tempFile.write(reinterpret_cast<char*>(writeBuffer), writeBufferIndex + (byteIndex > 0));
-
-    writeBufferIndex = 0;
-    byteIndex = 0;
-    bytesFromTheLastRead = "";
+    tempWriter.Finish();
 
     tempFile.close();
     file.close();
 
-    int new_temp_file_idx = temp_file_idx;
-    while(new_temp_file_idx < INT_MAX && FileExists(filesystem::temp_directory_path().string() + compressedFileName + "_" + to_string(new_temp_file_idx) + ".txt"))
-        new_temp_file_idx++;
+    const string oldFileAddress = OldArchiveAddress(compressedFile);
 
-    rename(compressedFile.c_str(), (filesystem::temp_directory_path().string() + compressedFileName + "_" + to_string(new_temp_file_idx) + ".txt").c_str());
+    rename(compressedFile.c_str(), oldFileAddress.c_str());
 
-    ifstream oldFile(filesystem::temp_directory_path().string() + compressedFileName + "_" + to_string(new_temp_file_idx) + ".txt", ios::binary);
+    ifstream oldFile(oldFileAddress, ios::binary);
     if(!oldFile) {
         archive_corrupted = true;
         return;
@@ -2481,7 +2916,7 @@ void MoveFiles(const string &compressedFile, vector<int> indices, const int &ind
     if(!tempFileRead) {
         archive_corrupted = true;
         oldFile.close();
-        remove((filesystem::temp_directory_path().string() + compressedFileName + "_" + to_string(new_temp_file_idx) + ".txt").c_str());
+        remove(oldFileAddress.c_str());
         return;
     }
     ofstream newFile(compressedFile, ios::binary);
@@ -2489,26 +2924,43 @@ void MoveFiles(const string &compressedFile, vector<int> indices, const int &ind
         archive_corrupted = true;
         oldFile.close();
         tempFileRead.close();
-        remove((filesystem::temp_directory_path().string() + compressedFileName + "_" + to_string(new_temp_file_idx) + ".txt").c_str());
+        remove(oldFileAddress.c_str());
         remove((filesystem::temp_directory_path().string() + compressedFileName + "_" + to_string(temp_file_idx) + ".txt").c_str());
         return;
     }
+    BitWriter writer(newFile);
+
+    BitReader oldReader(oldFile), tempReader(tempFileRead);
+    addresses = GetCompressedFilesWithFile(oldReader);
+    WriteArchiveHeader(writer, archiveHeader);
+
+    ostringstream namesStream;
+    BitWriter namesWriter(namesStream);
+    BitWriter &nameWriter = directory ? namesWriter : writer;
+    size_t nextMoved = 0;
+    rewrite = StartRewrite(oldFileAddress, compressedFile);
+
+    auto copyMovedFile = [&]() {
+        if(directory)
+            CopyEntry(oldReader, archiveDirectory.entries[movedEntries[nextMoved++]], writer, rewrite);
+        else
+            TravelFile(tempReader, &writer);
+    };
 
-    addresses = GetCompressedFilesWithFile(oldFile);
     last = 0;
     for(auto i : indices) {
         while(last < i) {
             if(last == index) {
                 for(auto j : filesToMove)
                     if(j.first != "")
-                        CompressFileName(j.first, newFile, j.second);
+                        CompressFileName(j.first, nameWriter, j.second);
                     else
-                        WriteToBuffer(newFile, 0);
+                        nameWriter.Put(0, 8);
             }
             if(addresses[last].first != "")
-                CompressFileName(addresses[last].first, newFile, addresses[last].second);
+                CompressFileName(addresses[last].first, nameWriter, addresses[last].second);
             else
-                WriteToBuffer(newFile, 0);
+                nameWriter.Put(0, 8);
             last++;
         }
 
@@ -2529,43 +2981,42 @@ void MoveFiles(const string &compressedFile, vector<int> indices, const int &ind
         if(last == index) {
                 for(auto j : filesToMove)
                     if(j.first != "")
-                        CompressFileName(j.first, newFile, j.second);
+                        CompressFileName(j.first, nameWriter, j.second);
                     else
-                        WriteToBuffer(newFile, 0);
+                        nameWriter.Put(0, 8);
             }
             if(addresses[last].first != "")
-                CompressFileName(addresses[last].first, newFile, addresses[last].second);
+                CompressFileName(addresses[last].first, nameWriter, addresses[last].second);
             else
-                WriteToBuffer(newFile, 0);
+                nameWriter.Put(0, 8);
             last++;
     }
 
     if(index == (int) addresses.size()) {
         for(auto j : filesToMove)
                     if(j.first != "")
-                        CompressFileName(j.first, newFile, j.second);
+                        CompressFileName(j.first, nameWriter, j.second);
                     else
-                        WriteToBuffer(newFile, 0);
+                        nameWriter.Put(0, 8);
     }
 
-    WriteToBuffer(newFile, 0);
+    nameWriter.Put(0, 8);
 
     *progress = 0.55f;
 
     last = 0;
-    string saveBytes = "";
     for(auto i : indices) {
         while(last < i) {
             if(last == index) {
                 for(auto j : filesToMove)
                     if(j.second) {
-                        TravelFileToMove(tempFileRead, newFile, saveBytes);
+                        copyMovedFile();
 
                         *progress += 0.45f / len;
                     }
             }
             if(addresses[last].second) {
-                TravelFile(oldFile, newFile);
+                TravelFile(oldReader, &writer, rewrite);
 
                 *progress += 0.45f / len;
             }
@@ -2573,7 +3024,7 @@ void MoveFiles(const string &compressedFile, vector<int> indices, const int &ind
         }
 
         if(addresses[i].second) {
-            TravelFile(oldFile);
+            TravelFile(oldReader, nullptr, rewrite);
 
             *progress += 0.45f / len;
         }
@@ -2583,7 +3034,7 @@ void MoveFiles(const string &compressedFile, vector<int> indices, const int &ind
 
         while(f > 0) {
             if(addresses[i].second) {
-                TravelFile(oldFile);
+                TravelFile(oldReader, nullptr, rewrite);
 
                 *progress += 0.45f / len;
             }
@@ -2601,13 +3052,13 @@ void MoveFiles(const string &compressedFile, vector<int> indices, const int &ind
         if(last == index) {
                 for(auto j : filesToMove)
                     if(j.second) {
-                        TravelFileToMove(tempFileRead, newFile, saveBytes);
+                        copyMovedFile();
 
                         *progress += 0.45f / len;
                     }
             }
             if(addresses[last].second) {
-                TravelFile(oldFile, newFile);
+                TravelFile(oldReader, &writer, rewrite);
 
                 *progress += 0.45f / len;
             }
@@ -2618,7 +3069,7 @@ void MoveFiles(const string &compressedFile, vector<int> indices, const int &ind
     if(index == (int) addresses.size()) {
         for(auto j : filesToMove)
                     if(j.second) {
-                        TravelFileToMove(tempFileRead, newFile, saveBytes);
+                        copyMovedFile();
 
                         *progress += 0.45f / len;
                     }
@@ -2626,15 +3077,16 @@ void MoveFiles(const string &compressedFile, vector<int> indices, const int &ind
 
     *progress = 1;
 
-    if(byteIndex > 0)
-        writeBuffer[writeBufferIndex] <<= (8 - byteIndex);
-    newFile.write(reinterpret_cast<char*>(writeBuffer), writeBufferIndex + (byteIndex > 0));
+    if(directory)
+        WriteDirectory(writer, TakeStream(namesWriter, namesStream), rewrite.entries);
+
+    writer.Finish();
 
     oldFile.close();
     newFile.close();
     tempFileRead.close();
 
-    remove((filesystem::temp_directory_path().string() + compressedFileName + "_" + to_string(new_temp_file_idx) + ".txt").c_str());
+    remove(oldFileAddress.c_str());
     remove((filesystem::temp_directory_path().string() + compressedFileName + "_" + to_string(temp_file_idx) + ".txt").c_str());
 }
 
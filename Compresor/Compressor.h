@@ -2,10 +2,32 @@
 
 #include <vector>
 #include <string>
+#include <atomic>
 
-extern bool &archive_corrupted;
+extern std::atomic<bool> &archive_corrupted;
 
-void Compress(const std::vector<std::string> &filesToCompressAddress, const std::string &compressedFileAddress, float &progress);
+//compression levels go from 1 (fastest) to 9 (smallest archive), 10 replaces lazy matching with a much slower optimal parse
+constexpr int FAST_COMPRESSION = 1;
+constexpr int DEFAULT_COMPRESSION = 6;
+constexpr int MAX_COMPRESSION = 9;
+constexpr int ULTRA_COMPRESSION = 10;
+
+//files larger than the chunk size are split in chunks that are compressed and decompressed on separate threads
+//0 keeps every file in a single chunk, other values are clamped to [MIN_CHUNK_SIZE, MAX_CHUNK_SIZE]
+constexpr unsigned int DEFAULT_CHUNK_SIZE = 8u << 20;
+constexpr unsigned int MIN_CHUNK_SIZE = 1u << 20;
+constexpr unsigned int MAX_CHUNK_SIZE = 64u << 20;
+
+//how far back a match can be, rounded up to a power of 2 in [DEFAULT_WINDOW_SIZE, MAX_WINDOW_SIZE]
+//the compressor needs about 6 bytes per byte of window on every thread, the decompressor 2
+constexpr unsigned int DEFAULT_WINDOW_SIZE = 32u << 10;
+constexpr unsigned int LARGE_WINDOW_SIZE = 4u << 20;
+constexpr unsigned int MAX_WINDOW_SIZE = 8u << 20;
+
+//primed chunks can use the end of the previous chunk as dictionary: smaller archive, but only compression runs in parallel
+//the dictionary is at most min(windowSize, chunkSize) bytes, so large windows do not make every chunk hash a whole window again;
+//with a window larger than the chunks the archive is then larger than with one chunk per file, but compressed several times faster
+void Compress(const std::vector<std::string> &filesToCompressAddress, const std::string &compressedFileAddress, float &progress, int level = DEFAULT_COMPRESSION, unsigned int chunkSize = DEFAULT_CHUNK_SIZE, bool primedChunks = false, unsigned int windowSize = DEFAULT_WINDOW_SIZE);
 
 void Decompress(const std::string &toDecompressFolderAddress, const std::string &compressedFileAddress);
 
@@ -15,10 +37,14 @@ void Decompress(const std::string &toDecompressFolderAddress, const std::string
 
 void Decompress(const std::string &toDecompressFolderAddress, const std::string &compressedFileAddress, std::vector<int> indices, float &progress);
 
-void InsertFile(const std::string &fileToCompress, const std::string &compressedFile, const int &index, float &progress);
+void InsertFile(const std::string &fileToCompress, const std::string &compressedFile, const int &index, float &progress, int level = DEFAULT_COMPRESSION);
 
 void DeleteFiles(const std::string &compressedFile, std::vector<int> indices, float &progress);
 
 void MoveFiles(const std::string &compressedFile, std::vector<int> indices, const int &index, float &progress);
 
+//inserting and deleting files only appends to an archive, this writes it again without the space they left behind
+//edits also do it on their own once that space is more than half of the archive
+void CompactArchive(const std::string &compressedFile, float &progress);
+
 std::vector<std::pair<std::string, bool>> GetCompressedFiles(const std::string &compressedFileAddress);
\ No newline at end of file
@@ -4,15 +4,23 @@
 #include <fstream>
 
 #include <cstring>
+#include <cmath>
 #include <string>
 
 #include <functional>
 #include <algorithm>
 
 #include <vector>
+#include <array>
 #include <deque>
 #include <unordered_map>
 #include <queue>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <future>
 
 #include <sys/stat.h>
 #include <direct.h>
@@ -23,33 +31,285 @@
 using namespace std;
 
 struct LZ77 {
-    uint16_t offset;
+    uint32_t offset;
     uint16_t length;
     unsigned char character;
 };
 
-struct HuffmanNode {
-    int value;
-    uint64_t frequency;
-    HuffmanNode *left, *right;
+constexpr int HUFFMAN_MAX_SYMBOLS = 286; //the literal and length alphabet, the offset alphabets are smaller
+constexpr int MAX_CODE_LENGTH = 15; //longer codes are limited with package-merge, the tables store lengths on 5 (literals) and 4 bits (offsets)
 
-    HuffmanNode(int val, uint64_t freq, HuffmanNode* l = nullptr, HuffmanNode *r = nullptr) : value(val), frequency(freq), left(l), right(r) {}
-};
+//canonical Huffman codes are decoded with a table indexed by their first HUFFMAN_TABLE_BITS bits, longer codes continue in a second level table
+constexpr int HUFFMAN_TABLE_BITS = 10;
+constexpr uint32_t HUFFMAN_SUBTABLE = 1u << 31;
+constexpr int HUFFMAN_PEEK_BITS = 32; //enough for the longest code, legacy archives allow 31 bits
 
-constexpr int WRITE_BUFFER_SIZE = 4096;
-constexpr int READ_BUFFER_SIZE = 4096; //must be at least 4060
+constexpr int WRITE_BUFFER_SIZE = 1 << 16; //bytes a BitWriter collects before writing them to its stream
+constexpr int READ_BUFFER_SIZE = 4096;
+constexpr int BIT_READ_BUFFER_SIZE = 1 << 16; //bytes a BitReader reads from its stream at once
 
 constexpr int LOOKAHEAD_SIZE = 258;
-constexpr int WINDOW_SIZE = 32768;
+constexpr int WINDOW_SIZE = 32768; //the window of archives without a window size in their header
+constexpr int WINDOW_LOG = 15;
+constexpr int MAX_WINDOW_LOG = 23;
+constexpr int MAX_OFFSET_CODES = 2 * MAX_WINDOW_LOG; //a window of 2^n bytes needs 2n offset codes
 
 constexpr int MIN_MATCH = 3;
-constexpr int MOD = 65521;
-constexpr int BASE = 256;
 
-extern string bytesFromTheLastRead;
-extern string tempFileName;
-extern unsigned char writeBuffer[WRITE_BUFFER_SIZE], writeBuffer_2[WRITE_BUFFER_SIZE];
-extern int writeBufferIndex, byteIndex, writeBufferIndex_2, byteIndex_2;
-extern const char* BYTE_TO_BITS[256];
+//the symbols of lengths and offsets are looked up in tables filled at compile time, shared by the encoder and the decoders
+//LENGTH_CODES maps a length to its symbol and extra bits, LENGTH_BASES and OFFSET_BASES map a symbol back to the smallest value
+//it codes; offsets below 512 find their symbol in OFFSET_SYMBOLS (indexed by offset - 1), larger ones by their top bits
+struct LengthCode {
+    uint16_t symbol;
+    uint8_t extraBits, extraValue;
+};
+
+struct CodeBase {
+    uint32_t base;
+    uint8_t extraBits;
+};
+
+constexpr array<CodeBase, 29> MakeLengthBases() {
+    array<CodeBase, 29> bases{};
+    uint32_t base = MIN_MATCH;
+
+    //symbols 257 - 264 code a single length, then every 4 symbols get one more extra bit; 285 is only 258
+    for(int i = 0; i < 28; i++) {
+        uint8_t extraBits = static_cast<uint8_t>(i < 8 ? 0 : i / 4 - 1);
+        bases[i] = {base, extraBits};
+        base += 1u << extraBits;
+    }
+    bases[28] = {LOOKAHEAD_SIZE, 0};
+
+    return bases;
+}
+
+constexpr array<CodeBase, 29> LENGTH_BASES = MakeLengthBases(); //indexed by symbol - 257
+
+constexpr array<LengthCode, LOOKAHEAD_SIZE + 1> MakeLengthCodes() {
+    array<LengthCode, LOOKAHEAD_SIZE + 1> codes{};
+
+    for(int i = 0; i < 29; i++)
+        for(uint32_t value = 0; value < (1u << LENGTH_BASES[i].extraBits); value++)
+            if(LENGTH_BASES[i].base + value < LOOKAHEAD_SIZE || i == 28)
+                codes[LENGTH_BASES[i].base + value] = {static_cast<uint16_t>(257 + i), LENGTH_BASES[i].extraBits, static_cast<uint8_t>(value)};
+
+    return codes;
+}
+
+constexpr array<LengthCode, LOOKAHEAD_SIZE + 1> LENGTH_CODES = MakeLengthCodes();
+
+constexpr array<CodeBase, MAX_OFFSET_CODES> MakeOffsetBases() {
+    array<CodeBase, MAX_OFFSET_CODES> bases{};
+
+    //offsets 1 - 4 have their own codes, then every power of 2 is split in two codes with the same number of extra bits
+    for(int i = 0; i < MAX_OFFSET_CODES; i++) {
+        if(i < 4)
+            bases[i] = {static_cast<uint32_t>(i + 1), 0};
+        else
+            bases[i] = {((2u | (i & 1)) << (i / 2 - 1)) + 1, static_cast<uint8_t>(i / 2 - 1)};
+    }
+
+    return bases;
+}
+
+constexpr array<CodeBase, MAX_OFFSET_CODES> OFFSET_BASES = MakeOffsetBases();
+
+constexpr array<uint8_t, 512> MakeOffsetSymbols() {
+    array<uint8_t, 512> symbols{};
+
+    for(int symbol = 0; symbol < 18; symbol++)
+        for(uint32_t value = 0; value < (1u << OFFSET_BASES[symbol].extraBits); value++)
+            symbols[OFFSET_BASES[symbol].base - 1 + value] = static_cast<uint8_t>(symbol);
+
+    return symbols;
+}
+
+constexpr array<uint8_t, 512> OFFSET_SYMBOLS = MakeOffsetSymbols();
+
+//the hash chain heads are indexed by a multiplicative hash of the first hashBytes bytes, hashBits wide
+constexpr uint32_t HASH_MULTIPLIER = 2654435761u;
+constexpr int MIN_LOOKAHEAD = LOOKAHEAD_SIZE + MIN_MATCH + 1;
+constexpr int TOO_FAR = 4096;
+
+//head[h] is the newest position with hash h (stored as pos + 1, 0 means none)
+//prev[pos % windowSize] is how far back the previous position with the same hash is (0 means none)
+//ResetHashChain sizes everything for the hash width of the level and the window of the archive
+struct HashChain {
+    vector<uint64_t> head;
+    vector<uint32_t> prev; //binary trees keep the two children of every position here
+    vector<unsigned char> window;
+    uint64_t windowSize = 0;
+};
+
+struct CompressionLevel {
+    int maxChain; //how many older positions are checked for a match
+    int niceLength; //stop searching once a match is at least this long
+    int maxInsert; //positions inside longer matches are not added to the hash chain
+    int lazySteps; //0 - greedy, 1 or 2 - how many following positions are checked for a longer match
+    int goodLength; //search less when looking past a match at least this long
+    int maxLazy; //matches at least this long are taken without looking further
+    int hashBits; //the hash chain has 2^hashBits heads
+    int hashBytes; //how many bytes are hashed, 4 skips matches of 3 bytes
+    int binaryTree; //1 - positions are kept in binary trees instead of hash chains
+    int optimalPasses; //0 - lazy or greedy parsing, otherwise how many times the optimal parse of a segment refines its costs
+};
+
+//LZ77 tokens packed in 32 bits: length << 23 | (offset - 1) for matches, so offsets up to 8 MiB fit, the character for literals (length 0)
+constexpr uint64_t TOKEN_MEMORY_BUDGET = 64ull << 20; //past this many bytes the tokens of a file are moved to a temporary file
+
+struct TokenBuffer {
+    vector<uint32_t> tokens, spillBuffer;
+    uint64_t capacity, spilled, spillRead;
+    size_t readIdx;
+    HANDLE spillFile; //deleted by the system once closed
+
+    TokenBuffer(uint64_t budget = TOKEN_MEMORY_BUDGET) : capacity(max<uint64_t>(budget / sizeof(uint32_t), READ_BUFFER_SIZE)), spilled(0), spillRead(0), readIdx(0), spillFile(INVALID_HANDLE_VALUE) {}
+    TokenBuffer(const TokenBuffer&) = delete;
+    ~TokenBuffer() {
+        if(spillFile != INVALID_HANDLE_VALUE)
+            CloseHandle(spillFile);
+    }
+};
+
+//every entry is symbol << 8 | code length (0 - the bits are not a code),
+//or for the first bits of longer codes HUFFMAN_SUBTABLE | start of their second level table << 8 | bits to peek for it
+struct HuffmanDecoder {
+    vector<uint32_t> table;
+};
+
+//bits produced by one chunk when compressed on a worker thread
+struct CompressedStream {
+    string bytes;
+    unsigned char lastByte = 0; //the last lastBits bits of the stream, right aligned
+    int lastBits = 0;
+    uint64_t size = 0; //the bytes of the chunk and their CRC-32, for the directory
+    uint32_t checksum = 0;
+    bool done = false;
+};
+
+constexpr size_t PENDING_STREAMS_PER_THREAD = 2; //how far the workers may get ahead of the chunk being written
+
+//the part of a file that is compressed with its own Huffman tables
+struct FileChunk {
+    string address;
+    uint64_t start, length; //length is UINT64_MAX when the chunk goes to the end of the file
+    uint64_t dictionary; //how many bytes before start are loaded in the window but not encoded
+    bool final;
+    float share; //part of the file, for the progress bar
+};
+
+//archives written before the header existed have version 0 and keep every file in a single unframed block
+struct ArchiveHeader {
+    uint8_t version = 0;
+    uint32_t chunkSize = 0; //0 - every file is a single chunk
+    bool primedChunks = false; //chunks may refer to the data of the previous chunk, so they are decoded in order
+    int windowLog = WINDOW_LOG; //offsets go up to 2^windowLog
+
+    uint32_t WindowSize() const { return 1u << windowLog; }
+    int OffsetCodes() const { return 2 * windowLog; }
+};
+
+constexpr uint8_t ARCHIVE_VERSION = 4;
+constexpr uint8_t BLOCK_TYPES_VERSION = 2; //from this version a chunk is a list of blocks, each with its own type
+constexpr uint8_t WINDOW_SIZE_VERSION = 3; //from this version bits 1 - 4 of the flags are windowLog - WINDOW_LOG
+constexpr uint8_t DIRECTORY_VERSION = 4; //from this version the names and a directory of the file streams are after the files
+constexpr int ARCHIVE_HEADER_SIZE = 9; //0, 'A', 'Z', version, chunk size (4 bytes), flags
+constexpr int DIRECTORY_FOOTER_SIZE = 12; //the byte where the directory starts (8 bytes), 0, 'A', 'Z', 'D'
+constexpr uint32_t DIRECTORY_MAGIC = 'A' << 16 | 'Z' << 8 | 'D';
+
+//where the stream of a file is in an archive with a directory, and what it decompresses to
+struct DirectoryEntry {
+    uint64_t offset; //in bits from the start of the archive
+    uint64_t bits;
+    uint64_t size; //decompressed bytes
+    uint32_t checksum; //CRC-32 of the decompressed bytes
+};
+
+struct ArchiveDirectory {
+    uint64_t offset = 0; //the byte where the names start, the entries follow them
+    vector<DirectoryEntry> entries; //one for every file, in the order of the names
+
+    //the bytes before the directory that no entry uses: streams of deleted files, older directories, padding
+    uint64_t DeadSpace() const {
+        uint64_t used = 0;
+        for(const auto &i : entries)
+            used += i.bits;
+
+        const uint64_t space = (offset - ARCHIVE_HEADER_SIZE) * 8;
+        return space > used ? (space - used) / 8 : 0;
+    }
+};
+
+constexpr double COMPACT_DEAD_SHARE = 0.5; //an edit compacts an archive once more than this part of it is dead space
+constexpr uint64_t COMPACT_MIN_DEAD_SPACE = 1 << 20; //and the dead space is at least this many bytes
+
+constexpr uint64_t SYSTEM_COPY_MIN_SIZE = 1 << 20; //smaller streams of an edited archive are copied through the reader and the writer
+constexpr uint32_t SYSTEM_COPY_BUFFER_SIZE = 1 << 20; //bytes read and written at once when clusters cannot be cloned
+
+//an archive with a directory that an edit operation writes again, the streams it keeps are copied from the old file
+struct ArchiveRewrite {
+    string from, to; //the old and the new file, empty when the streams are only copied through the reader
+    uint32_t cloneCluster = 0; //the cluster size when both files are on a volume that can clone clusters, 0 otherwise
+    vector<DirectoryEntry> entries; //the streams of the new archive
+    size_t next = 0; //the entry of the next file of the old archive
+};
+
+//CRC-32 as in zlib, slicing by 8: table k gives the CRC of a byte followed by k zero bytes
+constexpr uint32_t CRC32_POLYNOMIAL = 0xEDB88320u;
+constexpr int CHECKSUM_BUFFER_SIZE = 1 << 16; //bytes read at once when the checksum of a chunk is computed
+
+constexpr array<array<uint32_t, 256>, 8> MakeCrc32Tables() {
+    array<array<uint32_t, 256>, 8> tables{};
+
+    for(uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for(int j = 0; j < 8; j++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32_POLYNOMIAL : crc >> 1;
+        tables[0][i] = crc;
+    }
+
+    for(int k = 1; k < 8; k++)
+        for(int i = 0; i < 256; i++)
+            tables[k][i] = (tables[k - 1][i] >> 8) ^ tables[0][tables[k - 1][i] & 255];
+
+    return tables;
+}
+constexpr array<array<uint32_t, 256>, 8> CRC32_TABLES = MakeCrc32Tables();
+constexpr int CHUNK_LENGTH_BITS = 48; //every chunk starts with its final bit and its length in bits
+
+//block types, like BTYPE in Deflate
+constexpr int STORED_BLOCK = 0;
+constexpr int FIXED_BLOCK = 1;
+constexpr int DYNAMIC_BLOCK = 2;
+
+constexpr uint64_t BLOCK_SEGMENT_TOKENS = 16384; //a block may end after every this many tokens
+constexpr int MAX_BLOCK_SEGMENTS = 64;
+constexpr uint64_t MAX_STORED_BLOCK = UINT32_MAX; //the size of a stored block is saved on 32 bits
+
+//a chunk is stored without LZ77 when a few samples of it look like random data
+constexpr int PROBE_SAMPLES = 8;
+constexpr int PROBE_SAMPLE_SIZE = 16384;
+constexpr int PROBE_HASH_BITS = 14;
+constexpr double STORED_MIN_ENTROPY = 7.9; //bits per byte
+constexpr double STORED_MAX_MATCH_RATE = 0.02; //the share of positions with a 4 byte match in the same sample
+
+struct BlockPlan {
+    uint64_t tokens, bytes; //how many tokens the block holds and how many bytes they decode to
+    int type;
+    uint64_t bits; //the size of the block, header included
+    vector<int> lengthCodeLengths, offsetCodeLengths; //only for dynamic blocks
+};
+
+//the optimal parser looks for the cheapest tokens of this many bytes at once
+constexpr uint64_t OPTIMAL_SEGMENT_SIZE = 1 << 20;
+
+constexpr int MIN_COMPRESSION_LEVEL = 1;
+constexpr int MAX_COMPRESSION_LEVEL = 10;
+extern const CompressionLevel COMPRESSION_LEVELS[MAX_COMPRESSION_LEVEL + 1];
+
+extern ArchiveHeader archiveHeader;
+extern ArchiveDirectory archiveDirectory;
 
-extern bool archive_corrupted_help;
\ No newline at end of file
+//set by the worker threads of compression and decompression too, so it is atomic
+extern atomic<bool> archive_corrupted_help;
\ No newline at end of file
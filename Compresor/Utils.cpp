@@ -1,6 +1,11 @@
 #include "Utils.h"
 #include <cstdint>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define MATCH_LENGTH_SIMD
+#endif
+
 
 bool FileExists(string filename) {
     std::ifstream f(filename);
@@ -14,13 +19,109 @@ bool is_directory(const std::string& path) {
     return (info.st_mode & S_IFMT) == S_IFDIR;
 }
 
-uint32_t Hash(unsigned char buffer[], const int &bufferIdx, const int SIZE) {
-    uint32_t h = 0;
+//---------------------------------------------- MATCH LENGTH -----------------------------------------
+
+//each kernel returns how many bytes match and stops at limit, reading no byte past it
+
+int MatchLengthBytes(const unsigned char *match, const unsigned char *scan, int limit, int length = 0) {
+    while(length < limit && match[length] == scan[length])
+        length++;
+
+    return length;
+}
+
+#ifdef __GNUC__
+//8 bytes at a time: the lowest set bit of the xor is the first different byte (little endian)
+int MatchLength64(const unsigned char *match, const unsigned char *scan, int limit, int length = 0) {
+    for(; length + 8 <= limit; length += 8) {
+        uint64_t a, b;
+        memcpy(&a, match + length, 8);
+        memcpy(&b, scan + length, 8);
 
-    for(int i = bufferIdx; i < bufferIdx + MIN_MATCH; i++)
-        h = (h * BASE + buffer[i % SIZE]) %  MOD;
+        if(a != b)
+            return length + (__builtin_ctzll(a ^ b) >> 3);
+    }
 
-    return h;
+    return MatchLengthBytes(match, scan, limit, length);
+}
+#else
+int MatchLength64(const unsigned char *match, const unsigned char *scan, int limit, int length = 0) {
+    return MatchLengthBytes(match, scan, limit, length);
+}
+#endif
+
+#ifdef MATCH_LENGTH_SIMD
+__attribute__((target("sse2"))) int MatchLengthSSE2(const unsigned char *match, const unsigned char *scan, int limit) {
+    int length = 0;
+    for(; length + 16 <= limit; length += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(match + length));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(scan + length));
+        unsigned int equal = static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)));
+
+        if(equal != 0xFFFF)
+            return length + __builtin_ctz(~equal);
+    }
+
+    return MatchLength64(match, scan, limit, length);
+}
+
+__attribute__((target("avx2"))) int MatchLengthAVX2(const unsigned char *match, const unsigned char *scan, int limit) {
+    int length = 0;
+    for(; length + 32 <= limit; length += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(match + length));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(scan + length));
+        unsigned int equal = static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)));
+
+        if(equal != 0xFFFFFFFFu)
+            return length + __builtin_ctz(~equal);
+    }
+
+    return MatchLength64(match, scan, limit, length);
+}
+#endif
+
+//the widest kernel the processor supports, chosen once
+int (*SelectMatchLength())(const unsigned char*, const unsigned char*, int) {
+#ifdef MATCH_LENGTH_SIMD
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx2"))
+        return MatchLengthAVX2;
+    if(__builtin_cpu_supports("sse2"))
+        return MatchLengthSSE2;
+#endif
+
+    return [](const unsigned char *match, const unsigned char *scan, int limit) { return MatchLength64(match, scan, limit); };
+}
+
+static int (*const matchLengthKernel)(const unsigned char*, const unsigned char*, int) = SelectMatchLength();
+
+int MatchLength(const unsigned char *match, const unsigned char *scan, const int &limit) {
+    return matchLengthKernel(match, scan, limit);
+}
+
+//how many bits are needed to write value
+int BitsNeeded(uint32_t value) {
+    int bits = 0;
+    for(; value > 0; value >>= 1)
+        bits++;
+
+    return bits;
+}
+
+void ResetHashChain(HashChain &chain, const int &hashBits, const uint64_t &windowSize, const bool &binaryTree) {
+    chain.head.assign(size_t(1) << hashBits, 0);
+    chain.prev.assign(binaryTree ? 2 * windowSize : windowSize, 0);
+    chain.window.resize(2 * windowSize);
+    chain.windowSize = windowSize;
+}
+
+//prev keeps distances instead of positions, so it needs 4 bytes per entry whatever the size of the file
+void InsertHashChain(HashChain &chain, const uint32_t &h, const uint64_t &pos) {
+    uint64_t distance = chain.head[h] == 0 ? 0 : pos + 1 - chain.head[h];
+
+    chain.prev[pos & (chain.windowSize - 1)] = distance > chain.windowSize ? 0 : static_cast<uint32_t>(distance);
+    chain.head[h] = pos + 1;
 }
 
 void ReadDataToCompress(unsigned char bytes[], int &bytesLength, int &bytesLengthIdx, ifstream &file) {
@@ -30,225 +131,522 @@ void ReadDataToCompress(unsigned char bytes[], int &bytesLength, int &bytesLengt
     bytesLengthIdx = 0;
 }
 
-int ReadDataFromBuffer(unsigned char buffer[], int &bufferIdx, int &bufferByteIdx, int &bufferSize, ifstream &inputFile, uint8_t size) {
-    int ans = 0;
-    if(bufferByteIdx == 0) {
-        if(size == 8) {
-            ans = buffer[bufferIdx];
-            bufferIdx++;
-        }
-        else {
-            ans = buffer[bufferIdx] >> (8 - size);
-            bufferByteIdx = size;
-        }
+//matches keep the length in the top 9 bits and offset - 1 in the other 23, literals have length 0
+uint32_t PackToken(const LZ77 &token) {
+    if(token.length == 0)
+        return token.character;
 
-        size = 0;
-    }
-    else {
-        if(size <= 8 - bufferByteIdx) {
-            ans = (buffer[bufferIdx] << bufferByteIdx) >> (8 - size);
+    return (static_cast<uint32_t>(token.length) << MAX_WINDOW_LOG) | (token.offset - 1);
+}
 
-            if(size + bufferByteIdx == 8) {
-                bufferByteIdx = 0;
-                bufferIdx++;
-            }
-            else
-                bufferByteIdx += size;
+LZ77 UnpackToken(const uint32_t &token) {
+    uint16_t length = static_cast<uint16_t>(token >> MAX_WINDOW_LOG);
+    if(length == 0)
+        return {0, 0, static_cast<unsigned char>(token)};
+
+    return {(token & ((1u << MAX_WINDOW_LOG) - 1)) + 1, length, '-'};
+}
 
-            size = 0;
+void ClearTokenBuffer(TokenBuffer &buffer) {
+    buffer.tokens.clear();
+    buffer.spilled = 0;
+    buffer.spillRead = 0;
+    buffer.readIdx = 0;
+}
+
+void SpillTokens(TokenBuffer &buffer) {
+    if(buffer.spillFile == INVALID_HANDLE_VALUE) {
+        char tempPath[MAX_PATH], tempName[MAX_PATH];
+        if(GetTempPathA(MAX_PATH, tempPath) == 0 || GetTempFileNameA(tempPath, "azt", 0, tempName) == 0) {
+            archive_corrupted_help = true;
+            return;
         }
-        else {
-            uint8_t dim = 8 - bufferByteIdx;
-            size -= dim;
-            ans = (buffer[bufferIdx] << bufferByteIdx) >> bufferByteIdx;
-            bufferByteIdx = 0;
-            bufferIdx++;
+
+        buffer.spillFile = CreateFileA(tempName, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+        if(buffer.spillFile == INVALID_HANDLE_VALUE) {
+            cerr << "Error creating the temporary token file" << endl;
+            archive_corrupted_help = true;
+            return;
         }
     }
 
-    if(bufferIdx == bufferSize) {
-        inputFile.read(reinterpret_cast<char*>(buffer), READ_BUFFER_SIZE);
-        bufferIdx = 0;
-        bufferSize = static_cast<int>(inputFile.gcount());
+    if(buffer.spilled == 0) {
+        LARGE_INTEGER start;
+        start.QuadPart = 0;
+        SetFilePointerEx(buffer.spillFile, start, nullptr, FILE_BEGIN);
     }
 
-    if(size > 0) {
-        ans = (ans << size) | (buffer[bufferIdx] >> (8 - size));
-        bufferByteIdx = size;
+    DWORD written = 0;
+    DWORD size = static_cast<DWORD>(buffer.tokens.size() * sizeof(uint32_t));
+    if(!WriteFile(buffer.spillFile, buffer.tokens.data(), size, &written, nullptr) || written != size) {
+        cerr << "Error writing the temporary token file" << endl;
+        archive_corrupted_help = true;
+        return;
     }
 
-    return ans;
+    buffer.spilled += buffer.tokens.size();
+    buffer.tokens.clear();
+}
+
+void PushToken(TokenBuffer &buffer, const uint32_t &token) {
+    buffer.tokens.push_back(token);
+
+    if(buffer.tokens.size() == buffer.capacity)
+        SpillTokens(buffer);
+}
+
+void RewindTokenBuffer(TokenBuffer &buffer) {
+    buffer.spillRead = 0;
+    buffer.readIdx = 0;
+    buffer.spillBuffer.clear();
+
+    if(buffer.spilled > 0) {
+        LARGE_INTEGER start;
+        start.QuadPart = 0;
+        SetFilePointerEx(buffer.spillFile, start, nullptr, FILE_BEGIN);
+    }
 }
 
-int ReadDataFromBufferBig(unsigned char buffer[], int &bufferIdx, int &bufferByteIdx, int &bufferSize, ifstream &inputFile, uint8_t size) {
-    int ans = 0;
-    while(size >= 8) {
-        ans = (ans << 8) | (ReadDataFromBuffer(buffer, bufferIdx, bufferByteIdx, bufferSize, inputFile) & 255);
+bool NextToken(TokenBuffer &buffer, uint32_t &token) {
+    //the spilled tokens come first, then the ones still in memory
+    if(buffer.spillRead < buffer.spilled) {
+        if(buffer.readIdx == buffer.spillBuffer.size()) {
+            buffer.spillBuffer.resize(static_cast<size_t>(min<uint64_t>(READ_BUFFER_SIZE, buffer.spilled - buffer.spillRead)));
+
+            DWORD read = 0;
+            DWORD size = static_cast<DWORD>(buffer.spillBuffer.size() * sizeof(uint32_t));
+            if(!ReadFile(buffer.spillFile, buffer.spillBuffer.data(), size, &read, nullptr) || read != size) {
+                cerr << "Error reading the temporary token file" << endl;
+                archive_corrupted_help = true;
+                return false;
+            }
+            buffer.readIdx = 0;
+        }
+
+        token = buffer.spillBuffer[buffer.readIdx++];
+        buffer.spillRead++;
+
+        if(buffer.spillRead == buffer.spilled)
+            buffer.readIdx = 0;
 
-        size -= 8;
+        return true;
     }
 
-    if(size > 0) {
-        ans = (ans << size) | (ReadDataFromBuffer(buffer, bufferIdx, bufferByteIdx, bufferSize, inputFile, size) & ((1 << size) - 1));
+    if(buffer.readIdx < buffer.tokens.size()) {
+        token = buffer.tokens[buffer.readIdx++];
+        return true;
     }
 
-    return ans;
+    return false;
 }
 
-LZ77 ReadTokenFromBuffer(unsigned char buffer[],  int &bufferIdx, int &bufferByteIdx, int &bufferSize, ifstream &inputFile) {
-    LZ77 token;
-    token.character = ReadDataFromBuffer(buffer, bufferIdx, bufferByteIdx, bufferSize, inputFile);
-    token.length = ReadDataFromBufferBig(buffer, bufferIdx, bufferByteIdx, bufferSize, inputFile, 9);
+BitWriter::BitWriter(ostream &stream, uint64_t start) : stream(stream), buffer(WRITE_BUFFER_SIZE + sizeof(uint64_t)), written(start) {}
+
+void BitWriter::PutBytes(const unsigned char *bytes, size_t size) {
+    //byte aligned, the bytes can be copied as they are
+    if(count % 8 == 0) {
+        Flush();
+        stream.write(reinterpret_cast<const char*>(bytes), static_cast<streamsize>(size));
+        written += size;
+        return;
+    }
 
-    if(token.length > 0) {
-        token.offset = ReadDataFromBufferBig(buffer, bufferIdx, bufferByteIdx, bufferSize, inputFile, 16);
+    for(; size >= 7; bytes += 7, size -= 7) {
+        uint64_t word = 0;
+        for(int i = 0; i < 7; i++)
+            word = (word << 8) | bytes[i];
+        Put(word, 56);
     }
-    else
-        token.offset = 0;
 
-    return token;
+    for(size_t i = 0; i < size; i++)
+        Put(bytes[i], 8);
+}
+
+void BitWriter::Flush() {
+    FlushBits();
+    WriteBuffer();
 }
 
-void WriteToBuffer(ofstream &file, const unsigned char &byte, uint8_t size) {
-    unsigned char toWrite;
-    if(size != 8)
-        toWrite = ((1 << size) - 1) & byte;
-    else
-        toWrite = byte;
-    
-    if(byteIndex == 0) {
-        writeBuffer[writeBufferIndex] = toWrite;
-        if(size == 8)
-            writeBufferIndex++;
-        else
-            byteIndex = size;
-         
-        size = 0;
+void BitWriter::Finish() {
+    Flush();
+
+    if(count > 0) {
+        buffer[used++] = static_cast<unsigned char>(bits >> 56);
+        bits = 0;
+        count = 0;
+        WriteBuffer();
     }
-    else {
-        if(size <= 8 - byteIndex) {
-            writeBuffer[writeBufferIndex] = (writeBuffer[writeBufferIndex] << size) | toWrite;
+}
 
-            if(byteIndex + size == 8) {
-                writeBufferIndex++;
-                byteIndex = 0;
-            }
-            else
-                byteIndex += size;
+void BitWriter::Sync() {
+    Flush();
+    stream.flush();
+}
 
-            size = 0;
+void BitWriter::Skip(uint64_t size) {
+    stream.seekp(static_cast<streamoff>(size), ios::cur);
+    written += size;
+}
+
+void BitWriter::WriteBuffer() {
+    stream.write(reinterpret_cast<char*>(buffer.data()), static_cast<streamsize>(used));
+    written += used;
+    used = 0;
+}
+
+void WriteStreamToBuffer(BitWriter &writer, const CompressedStream &stream) {
+    writer.PutBytes(reinterpret_cast<const unsigned char*>(stream.bytes.data()), stream.bytes.size());
+
+    if(stream.lastBits > 0)
+        writer.Put(stream.lastByte, stream.lastBits);
+}
+
+CompressedStream TakeStream(BitWriter &writer, const ostringstream &stream) {
+    writer.Flush();
+
+    CompressedStream result;
+    result.bytes = stream.str();
+    result.lastByte = writer.PendingByte();
+    result.lastBits = writer.PendingBits();
+
+    return result;
+}
+
+BitReader::BitReader(istream &stream) : stream(stream), buffer(BIT_READ_BUFFER_SIZE) {}
+
+bool BitReader::FillBuffer() {
+    stream.read(reinterpret_cast<char*>(buffer.data()), static_cast<streamsize>(buffer.size()));
+    pos = 0;
+    end = static_cast<size_t>(stream.gcount());
+
+    return end > 0;
+}
+
+void BitReader::Refill() {
+    //a whole word at once while the buffer has one, the bits after the new count are those of the next byte anyway
+    if(end - pos >= sizeof(uint64_t)) {
+        RefillFast();
+        return;
+    }
+
+    while(count <= MAX_PEEK_BITS) {
+        if(pos == end && !FillBuffer()) {
+            //past the end the window is filled with 0 bits, Overrun tells when they are read
+            padding += 64 - count;
+            count = 64;
+            return;
         }
-        else {
-            uint8_t dim = 8 - byteIndex;
-            size -= dim;
-            writeBuffer[writeBufferIndex] = (writeBuffer[writeBufferIndex] << dim) | (toWrite >> size);
-            writeBufferIndex++;
-            byteIndex = 0;
+
+        window |= static_cast<uint64_t>(buffer[pos++]) << (56 - count);
+        count += 8;
+    }
+}
+
+void BitReader::DropWindow() {
+    window = 0;
+    count = 0;
+}
+
+void BitReader::ReadBytes(unsigned char *bytes, size_t size) {
+    if(count % 8 != 0) {
+        for(; size >= 7; bytes += 7, size -= 7) {
+            uint64_t word = Read(56);
+            for(int i = 6; i >= 0; i--, word >>= 8)
+                bytes[i] = static_cast<unsigned char>(word);
         }
+
+        for(size_t i = 0; i < size; i++)
+            bytes[i] = static_cast<unsigned char>(Read(8));
+
+        return;
     }
 
-    if(writeBufferIndex == WRITE_BUFFER_SIZE) {
-        file.write(reinterpret_cast<char*>(writeBuffer), writeBufferIndex);
+    //byte aligned, the whole bytes left in the window go first, then the bytes are copied from the buffer
+    for(; size > 0 && count > 0; size--)
+        *bytes++ = static_cast<unsigned char>(Read(8));
 
-        writeBufferIndex = 0;
+    if(size == 0)
+        return;
+
+    if(padding > 0) {
+        truncated = true;
+        return;
     }
 
-    if(size != 0) {
-        writeBuffer[writeBufferIndex] = toWrite & ((1 << size) - 1);
-        byteIndex = size;
+    DropWindow();
+    while(size > 0) {
+        if(pos == end && !FillBuffer()) {
+            truncated = true;
+            return;
+        }
+
+        size_t available = min(size, end - pos);
+        memcpy(bytes, &buffer[pos], available);
+        pos += available;
+        bytes += available;
+        size -= available;
     }
 }
 
-void WriteToBufferBig(ofstream &outFile, const long long &byte, uint8_t size) {
-    long long toWrite = byte;
-    toWrite = (toWrite << (64 - size)) >> (64 - size);
+void BitReader::SkipBits(uint64_t bits) {
+    if(bits < static_cast<uint64_t>(count)) {
+        Consume(static_cast<int>(bits));
+        return;
+    }
+
+    //the window ends with 0 bits added after the end of the stream
+    if(padding > 0) {
+        truncated = true;
+        return;
+    }
+
+    bits -= count;
+    DropWindow();
 
-    while(size >= 8) {
-        WriteToBuffer(outFile, (toWrite >> (size - 8)));
+    //the whole bytes after the window are skipped in the buffer, the rest are not read at all
+    uint64_t bytes = bits / 8;
+    uint64_t inBuffer = min<uint64_t>(bytes, end - pos);
+    pos += static_cast<size_t>(inBuffer);
+    bytes -= inBuffer;
 
-        toWrite = (toWrite << (64 - size)) >> (64 - size);
-        size -= 8;
+    if(bytes > 0) {
+        stream.seekg(static_cast<streamoff>(bytes), ios::cur);
+        if(!stream) {
+            truncated = true;
+            return;
+        }
     }
 
-    if(size > 0)
-        WriteToBuffer(outFile, toWrite, size);
+    Read(static_cast<int>(bits % 8));
 }
 
-void WriteToBuffer_2(ofstream &file, const unsigned char &byte, uint8_t size) {
-    unsigned char toWrite;
-    if(size != 8)
-        toWrite = ((1 << size) - 1) & byte;
-    else
-        toWrite = byte;
-    
-    if(byteIndex_2 == 0) {
-        writeBuffer_2[writeBufferIndex_2] = toWrite;
-        if(size == 8)
-            writeBufferIndex_2++;
-        else
-            byteIndex_2 = size;
-        
-        size = 0;
+void BitReader::Seek(uint64_t bit) {
+    DropWindow();
+    pos = end = 0;
+    padding = 0;
+    truncated = false;
+
+    stream.clear();
+    stream.seekg(static_cast<streamoff>(bit / 8));
+    if(!stream) {
+        truncated = true;
+        return;
     }
-    else {
-        if(size <= 8 - byteIndex_2) {
-            writeBuffer_2[writeBufferIndex_2] = (writeBuffer_2[writeBufferIndex_2] << size) | toWrite;
 
-            if(byteIndex_2 + size == 8) {
-                writeBufferIndex_2++;
-                byteIndex_2 = 0;
-            }
-            else
-                byteIndex_2 += size;
+    Read(static_cast<int>(bit % 8));
+}
 
-            size = 0;
-        }
-        else {
-            uint8_t dim = 8 - byteIndex_2;
-            size -= dim;
-            writeBuffer_2[writeBufferIndex_2] = (writeBuffer_2[writeBufferIndex_2] << dim) | (toWrite >> size);
-            writeBufferIndex_2++;
-            byteIndex_2 = 0;
+uint64_t BitReader::StreamSize() {
+    stream.clear();
+    const streampos current = stream.tellg();
+    stream.seekg(0, ios::end);
+    const streampos size = stream.tellg();
+    stream.seekg(current);
+
+    return size < 0 ? 0 : static_cast<uint64_t>(size);
+}
+
+void BitReader::CopyBits(uint64_t bits, BitWriter &writer) {
+    //the bits in the window go through both accumulators
+    while(bits > 0 && count > 0) {
+        int size = static_cast<int>(min<uint64_t>(bits, min(count, MAX_PEEK_BITS)));
+        writer.Put(Read(size), size);
+        bits -= size;
+    }
+
+    if(bits == 0)
+        return;
+
+    if(padding > 0) {
+        truncated = true;
+        return;
+    }
+
+    //the window is empty, so the reader is at a byte boundary and whole bytes are copied from the buffer
+    DropWindow();
+    while(bits >= 8) {
+        if(pos == end && !FillBuffer()) {
+            truncated = true;
+            return;
         }
+
+        size_t available = static_cast<size_t>(min<uint64_t>(bits / 8, end - pos));
+        writer.PutBytes(&buffer[pos], available);
+        pos += available;
+        bits -= available * 8;
     }
 
-    if(writeBufferIndex_2 == WRITE_BUFFER_SIZE) {
-        file.write(reinterpret_cast<char*>(writeBuffer_2), writeBufferIndex_2);
+    if(bits > 0)
+        writer.Put(Read(static_cast<int>(bits)), static_cast<int>(bits));
+}
+
+streamsize ChecksumBuffer::xsputn(const char *bytes, streamsize count) {
+    checksum = Crc32(checksum, reinterpret_cast<const unsigned char*>(bytes), static_cast<size_t>(count));
+    size += static_cast<uint64_t>(count);
+
+    return target->sputn(bytes, count);
+}
 
-        writeBufferIndex_2 = 0;
+ChecksumBuffer::int_type ChecksumBuffer::overflow(int_type c) {
+    if(traits_type::eq_int_type(c, traits_type::eof()))
+        return traits_type::not_eof(c);
+
+    const unsigned char byte = static_cast<unsigned char>(c);
+    checksum = Crc32(checksum, &byte, 1);
+    size++;
+
+    return target->sputc(static_cast<char>(byte));
+}
+
+uint32_t Crc32(uint32_t crc, const unsigned char *bytes, size_t size) {
+    crc = ~crc;
+
+    for(; size >= 8; bytes += 8, size -= 8) {
+        uint32_t low, high;
+        memcpy(&low, bytes, 4);
+        memcpy(&high, bytes + 4, 4);
+        low ^= crc;
+
+        crc = CRC32_TABLES[7][low & 255] ^ CRC32_TABLES[6][(low >> 8) & 255] ^ CRC32_TABLES[5][(low >> 16) & 255] ^ CRC32_TABLES[4][low >> 24] ^
+              CRC32_TABLES[3][high & 255] ^ CRC32_TABLES[2][(high >> 8) & 255] ^ CRC32_TABLES[1][(high >> 16) & 255] ^ CRC32_TABLES[0][high >> 24];
     }
 
-    if(size != 0) {
-        writeBuffer_2[writeBufferIndex_2] = toWrite & ((1 << size) - 1);
-        byteIndex_2 = size;
+    for(; size > 0; bytes++, size--)
+        crc = CRC32_TABLES[0][(crc ^ *bytes) & 255] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+//a * b modulo the CRC polynomial, the bits are reflected: bit 31 is x^0
+static uint32_t MultiplyModPolynomial(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+
+    for(uint32_t mask = 1u << 31; mask != 0; mask >>= 1) {
+        if(a & mask)
+            product ^= b;
+        b = b & 1 ? (b >> 1) ^ CRC32_POLYNOMIAL : b >> 1;
     }
+
+    return product;
 }
 
-void WriteToBufferBig_2(ofstream &outFile, const long long &byte, uint8_t size) {
-    long long toWrite = byte;
-    toWrite = (toWrite << (64 - size)) >> (64 - size);
+uint32_t Crc32Combine(uint32_t crc1, uint32_t crc2, uint64_t size2) {
+    //crc1 is moved past size2 zero bytes by multiplying it with x^(8 * size2), built from the powers x^(2^k)
+    uint32_t power = 1u << 30, shift = 1u << 31;
+    for(uint64_t bits = size2 * 8; bits > 0; bits >>= 1) {
+        if(bits & 1)
+            shift = MultiplyModPolynomial(power, shift);
+        power = MultiplyModPolynomial(power, power);
+    }
 
-    while(size >= 8) {
-        WriteToBuffer_2(outFile, (toWrite >> (size - 8)));
+    return MultiplyModPolynomial(shift, crc1) ^ crc2;
+}
 
-        toWrite = (toWrite << (64 - size)) >> (64 - size);
-        size -= 8;
+//---------------------------------------------- FILE RANGES -----------------------------------------
+
+//the cluster size when both files are on the same volume and it can share clusters between files (block cloning), 0 otherwise
+uint32_t CloneClusterSize(const string &from, const string &to) {
+    const DWORD share = FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE;
+    HANDLE source = CreateFileA(from.c_str(), GENERIC_READ, share, nullptr, OPEN_EXISTING, 0, nullptr);
+    HANDLE target = CreateFileA(to.c_str(), GENERIC_READ, share, nullptr, OPEN_EXISTING, 0, nullptr);
+    DWORD sourceVolume = 0, targetVolume = 0, flags = 0, returned = 0;
+    FSCTL_GET_INTEGRITY_INFORMATION_BUFFER integrity;
+    uint32_t cluster = 0;
+
+    if(source != INVALID_HANDLE_VALUE && target != INVALID_HANDLE_VALUE
+       && GetVolumeInformationByHandleW(source, nullptr, 0, &sourceVolume, nullptr, nullptr, nullptr, 0)
+       && GetVolumeInformationByHandleW(target, nullptr, 0, &targetVolume, nullptr, &flags, nullptr, 0)
+       && sourceVolume == targetVolume && (flags & FILE_SUPPORTS_BLOCK_REFCOUNTING)
+       && DeviceIoControl(target, FSCTL_GET_INTEGRITY_INFORMATION, nullptr, 0, &integrity, sizeof(integrity), &returned, nullptr))
+        cluster = integrity.ClusterSizeInBytes;
+
+    if(source != INVALID_HANDLE_VALUE)
+        CloseHandle(source);
+    if(target != INVALID_HANDLE_VALUE)
+        CloseHandle(target);
+
+    return cluster;
+}
+
+static bool CopyFileBytes(HANDLE source, const uint64_t &fromOffset, HANDLE target, const uint64_t &toOffset, uint64_t size) {
+    if(size == 0)
+        return true;
+
+    LARGE_INTEGER from, to;
+    from.QuadPart = static_cast<LONGLONG>(fromOffset);
+    to.QuadPart = static_cast<LONGLONG>(toOffset);
+    if(!SetFilePointerEx(source, from, nullptr, FILE_BEGIN) || !SetFilePointerEx(target, to, nullptr, FILE_BEGIN))
+        return false;
+
+    vector<char> buffer(static_cast<size_t>(min<uint64_t>(size, SYSTEM_COPY_BUFFER_SIZE)));
+    while(size > 0) {
+        DWORD read = 0, written = 0;
+        DWORD length = static_cast<DWORD>(min<uint64_t>(size, buffer.size()));
+        if(!ReadFile(source, buffer.data(), length, &read, nullptr) || read == 0)
+            return false;
+        if(!WriteFile(target, buffer.data(), read, &written, nullptr) || written != read)
+            return false;
+        size -= read;
+    }
+
+    return true;
+}
+
+//copies size bytes from one file to another with the file handles, not through the streams of the program
+//with a cluster size the whole clusters are cloned, the file system shares them instead of copying the data,
+//which needs both offsets at the same place in a cluster; the bytes around them and any failed clone are read and written
+bool CopyFileRange(const string &from, const uint64_t &fromOffset, const string &to, const uint64_t &toOffset, const uint64_t &size, const uint32_t &cluster) {
+    const DWORD share = FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE;
+    HANDLE source = CreateFileA(from.c_str(), GENERIC_READ, share, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if(source == INVALID_HANDLE_VALUE)
+        return false;
+    HANDLE target = CreateFileA(to.c_str(), GENERIC_READ | GENERIC_WRITE, share, nullptr, OPEN_EXISTING, 0, nullptr);
+    if(target == INVALID_HANDLE_VALUE) {
+        CloseHandle(source);
+        return false;
     }
 
-    if(size > 0)
-        WriteToBuffer_2(outFile, toWrite, size);
+    //the cloned part, counted from the offsets
+    uint64_t cloneStart = 0, cloneEnd = 0;
+    if(cluster > 0 && fromOffset % cluster == toOffset % cluster) {
+        cloneStart = (cluster - fromOffset % cluster) % cluster;
+        if(cloneStart < size)
+            cloneEnd = cloneStart + (size - cloneStart) / cluster * cluster;
+
+        //the target has to hold the clusters before they are cloned into it
+        LARGE_INTEGER end;
+        end.QuadPart = static_cast<LONGLONG>(toOffset + size);
+        DUPLICATE_EXTENTS_DATA extents;
+        extents.FileHandle = source;
+        extents.SourceFileOffset.QuadPart = static_cast<LONGLONG>(fromOffset + cloneStart);
+        extents.TargetFileOffset.QuadPart = static_cast<LONGLONG>(toOffset + cloneStart);
+        extents.ByteCount.QuadPart = static_cast<LONGLONG>(cloneEnd - cloneStart);
+        DWORD returned = 0;
+
+        if(cloneEnd <= cloneStart || !SetFilePointerEx(target, end, nullptr, FILE_BEGIN) || !SetEndOfFile(target)
+           || !DeviceIoControl(target, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &extents, sizeof(extents), nullptr, 0, &returned, nullptr))
+            cloneStart = cloneEnd = 0;
+    }
+
+    bool copied = CopyFileBytes(source, fromOffset, target, toOffset, cloneStart)
+                  && CopyFileBytes(source, fromOffset + cloneEnd, target, toOffset + cloneEnd, size - cloneEnd);
+
+    CloseHandle(source);
+    CloseHandle(target);
+
+    return copied;
 }
 
-void WriteTokenToFile(LZ77 &token, unsigned char compressedBytes[], int &compressedBytesIdx, ofstream &file) {
+void WriteTokenToFile(LZ77 &token, unsigned char compressedBytes[], int &compressedBytesIdx, const int &windowSize, ostream &file) {
     if (token.length == 0 && token.offset == 0) {
         compressedBytes[compressedBytesIdx] = token.character;
         compressedBytesIdx++;
 
-        if(compressedBytesIdx == WINDOW_SIZE) {
-            file.write(reinterpret_cast<char*>(compressedBytes), WINDOW_SIZE);
+        if(compressedBytesIdx == windowSize) {
+            file.write(reinterpret_cast<char*>(compressedBytes), windowSize);
         }
-        else if(compressedBytesIdx == WINDOW_SIZE * 2) {
-            file.write(reinterpret_cast<char*>(compressedBytes + WINDOW_SIZE), WINDOW_SIZE);
+        else if(compressedBytesIdx == windowSize * 2) {
+            file.write(reinterpret_cast<char*>(compressedBytes + windowSize), windowSize);
 
             compressedBytesIdx = 0;
         }
@@ -257,16 +655,16 @@ void WriteTokenToFile(LZ77 &token, unsigned char compressedBytes[], int &compres
 
         for (int i = 0; i < token.length; ++i) {
             if(start + i < 0)
-                compressedBytes[compressedBytesIdx] = compressedBytes[start + i + 2 * WINDOW_SIZE];
+                compressedBytes[compressedBytesIdx] = compressedBytes[start + i + 2 * windowSize];
             else
                 compressedBytes[compressedBytesIdx] = compressedBytes[start + i];
             compressedBytesIdx++;
 
-            if(compressedBytesIdx == WINDOW_SIZE) {
-                file.write(reinterpret_cast<char*>(compressedBytes), WINDOW_SIZE);
+            if(compressedBytesIdx == windowSize) {
+                file.write(reinterpret_cast<char*>(compressedBytes), windowSize);
             }
-            else if(compressedBytesIdx == WINDOW_SIZE * 2) {
-                file.write(reinterpret_cast<char*>(compressedBytes + WINDOW_SIZE), WINDOW_SIZE);
+            else if(compressedBytesIdx == windowSize * 2) {
+                file.write(reinterpret_cast<char*>(compressedBytes + windowSize), windowSize);
                 compressedBytesIdx = 0;
             }
         }
@@ -275,63 +673,174 @@ void WriteTokenToFile(LZ77 &token, unsigned char compressedBytes[], int &compres
     token = {0, 0, 0};
 }
 
-void ReadDataToDecompress(string &s, ifstream &file, int &binaryLength, int &binaryPos) {
-    if(binaryPos > static_cast<int>(s.length())) {
-        cout << "Error at reading for decompressing: binaryPos > binary.length() (" << binaryPos << " > " << s.length() << ")" << endl;
-        exit(1);
+void FlushDecompressedBytes(unsigned char compressedBytes[], const int &compressedBytesIdx, const int &windowSize, ostream &file) {
+    if(compressedBytesIdx > 0 && compressedBytesIdx < windowSize)
+        file.write(reinterpret_cast<char*>(compressedBytes), compressedBytesIdx);
+    else if(compressedBytesIdx > 0)
+        file.write(reinterpret_cast<char*>(compressedBytes + windowSize), compressedBytesIdx - windowSize);
+}
+
+//copies the bytes of a stored block straight into the window, as many at once as fit before its next half is written
+void ReadStoredBytes(BitReader &reader, uint64_t size, unsigned char decompressedBytes[], int &decompressedBytesIdx, const int &windowSize, ostream &outFile) {
+    while(size > 0 && !reader.Overrun()) {
+        int room = (decompressedBytesIdx < windowSize ? windowSize : windowSize * 2) - decompressedBytesIdx;
+        int count = static_cast<int>(min<uint64_t>(size, room));
+
+        reader.ReadBytes(decompressedBytes + decompressedBytesIdx, count);
+        decompressedBytesIdx += count;
+        size -= count;
+
+        if(decompressedBytesIdx == windowSize)
+            outFile.write(reinterpret_cast<char*>(decompressedBytes), windowSize);
+        else if(decompressedBytesIdx == windowSize * 2) {
+            outFile.write(reinterpret_cast<char*>(decompressedBytes + windowSize), windowSize);
+            decompressedBytesIdx = 0;
+        }
     }
-    s.erase(0, binaryPos);
 
-    unsigned char bytes[READ_BUFFER_SIZE];
-    file.read(reinterpret_cast<char*>(bytes), READ_BUFFER_SIZE);
+    if(reader.Overrun())
+        archive_corrupted_help = true;
+}
 
-    streamsize readLength = file.gcount();
-    if(readLength == 0) {
-        binaryLength -= binaryPos;
-        binaryPos = 0;
+void WriteArchiveHeader(BitWriter &writer, const ArchiveHeader &header) {
+    if(header.version == 0)
         return;
+
+    writer.Put(0, 8);
+    writer.Put('A', 8);
+    writer.Put('Z', 8);
+    writer.Put(header.version, 8);
+    writer.Put(header.chunkSize, 32);
+    writer.Put(header.primedChunks | ((header.windowLog - WINDOW_LOG) << 1), 8);
+}
+
+bool ReadArchiveHeader(BitReader &reader, ArchiveHeader &header) {
+    header = ArchiveHeader();
+
+    //an old archive starts with the length of its first name, which is never 0 unless the archive is empty
+    if(reader.Peek(24) != ('A' << 8 | 'Z'))
+        return true;
+
+    reader.Consume(24);
+    header.version = static_cast<uint8_t>(reader.Read(8));
+    header.chunkSize = static_cast<uint32_t>(reader.Read(32));
+    uint8_t flags = static_cast<uint8_t>(reader.Read(8));
+    header.primedChunks = flags & 1;
+
+    if(reader.Overrun()) {
+        archive_corrupted_help = true;
+        return false;
     }
 
-    vector<char> bitBuffer(readLength * 8);
-    char* p = bitBuffer.data();
+    if(header.version > ARCHIVE_VERSION) {
+        cerr << "Unsupported archive version: " << static_cast<int>(header.version) << endl;
+        archive_corrupted_help = true;
+        return false;
+    }
+
+    if(header.version >= WINDOW_SIZE_VERSION)
+        header.windowLog = WINDOW_LOG + ((flags >> 1) & 15);
 
-    for (size_t i = 0; i < readLength; ++i) {
-        const char* const bits = BYTE_TO_BITS[bytes[i]];
-        memcpy(p, bits, 8);
-        p += 8;
+    if(header.windowLog > MAX_WINDOW_LOG) {
+        cerr << "Unsupported window size: 2^" << header.windowLog << endl;
+        archive_corrupted_help = true;
+        return false;
     }
 
-    s.append(bitBuffer.data(), readLength * 8);
-    binaryLength = binaryLength - binaryPos + static_cast<int>(readLength) * 8;
-    binaryPos = 0;
+    return true;
 }
 
-vector<pair<string, bool>> GetCompressedFilesWithFile(ifstream &file) {
-    if(!file)
-        return {};
+//the directory starts at a byte: the names as they were before the files, then an entry for every file
+//the footer after it is the byte where it starts and 0, 'A', 'Z', 'D'
+void WriteDirectory(BitWriter &writer, const CompressedStream &names, const vector<DirectoryEntry> &entries) {
+    auto put64 = [&](const uint64_t &value) {
+        writer.Put(value >> 32, 32);
+        writer.Put(value, 32);
+    };
+
+    writer.Finish();
+    const uint64_t offset = writer.Position() / 8;
+
+    WriteStreamToBuffer(writer, names);
+    for(const auto &i : entries) {
+        put64(i.offset);
+        put64(i.bits);
+        put64(i.size);
+        writer.Put(i.checksum, 32);
+    }
+    writer.Finish();
 
-    string binary = "";
-    int binaryLength = static_cast<int>(binary.length()), binaryPos = 0;
-    vector<pair<string, bool>> addresses; // 1 - file; 0 - folder
+    put64(offset);
+    writer.Put(DIRECTORY_MAGIC, 32);
+    writer.Finish();
+}
+
+//reads the footer and leaves the reader at the names of the directory
+bool SeekDirectory(BitReader &reader) {
+    const uint64_t size = reader.StreamSize();
+    if(size < ARCHIVE_HEADER_SIZE + DIRECTORY_FOOTER_SIZE) {
+        archive_corrupted_help = true;
+        return false;
+    }
 
-    uint8_t fileNameLen = 0;
+    reader.Seek((size - DIRECTORY_FOOTER_SIZE) * 8);
+    uint64_t offset = reader.Read(32) << 32;
+    offset |= reader.Read(32);
+    const uint64_t magic = reader.Read(32);
 
-    if(binaryLength < 8)
-        ReadDataToDecompress(binary, file, binaryLength, binaryPos);
-    
-    if(binaryLength < 8) {
+    if(reader.Overrun() || magic != DIRECTORY_MAGIC || offset < ARCHIVE_HEADER_SIZE || offset > size - DIRECTORY_FOOTER_SIZE) {
+        cerr << "The directory of the archive is missing" << endl;
         archive_corrupted_help = true;
-        return {};
+        return false;
+    }
+
+    archiveDirectory.offset = offset;
+    reader.Seek(offset * 8);
+
+    return true;
+}
+
+//reads the entries after the names, every stream has to be between the header and the directory
+void ReadDirectoryEntries(BitReader &reader, const size_t &files) {
+    auto read64 = [&]() {
+        uint64_t value = reader.Read(32) << 32;
+        return value | reader.Read(32);
+    };
+
+    const uint64_t end = archiveDirectory.offset * 8;
+    archiveDirectory.entries.resize(files);
+
+    for(auto &i : archiveDirectory.entries) {
+        i.offset = read64();
+        i.bits = read64();
+        i.size = read64();
+        i.checksum = static_cast<uint32_t>(reader.Read(32));
+
+        if(i.offset < ARCHIVE_HEADER_SIZE * 8 || i.offset > end || i.bits > end - i.offset) {
+            archive_corrupted_help = true;
+            return;
+        }
     }
-    
-    while(binaryPos < 8)
-        fileNameLen = fileNameLen * 2 + (binary[binaryPos++] == '1');
-    
+
+    if(reader.Overrun())
+        archive_corrupted_help = true;
+}
+
+vector<pair<string, bool>> GetCompressedFilesWithFile(BitReader &reader) {
+    archiveDirectory = ArchiveDirectory();
+    if(!ReadArchiveHeader(reader, archiveHeader))
+        return {};
+
+    if(archiveHeader.version >= DIRECTORY_VERSION && !SeekDirectory(reader))
+        return {};
+
+    vector<pair<string, bool>> addresses; // 1 - file; 0 - folder
+
+    uint8_t fileNameLen = static_cast<uint8_t>(reader.Read(8));
     string folderAddress = "";
 
-    while(fileNameLen != 0 || folderAddress != "") {
+    while((fileNameLen != 0 || folderAddress != "") && !reader.Overrun()) {
         if(fileNameLen == 0) {
-            int i = static_cast<int>(folderAddress.length()) - 1;
             while(folderAddress != "" && folderAddress.back() != '/')
                 folderAddress.pop_back();
             if(static_cast<int>(folderAddress.length()) == 0) {
@@ -341,18 +850,7 @@ vector<pair<string, bool>> GetCompressedFilesWithFile(ifstream &file) {
             folderAddress.pop_back();
 
             addresses.push_back({"", 0});
-            
-            if(8 + binaryPos >= binaryLength)
-                ReadDataToDecompress(binary, file, binaryLength, binaryPos);
-
-            if(8 + binaryPos >= binaryLength) {
-                archive_corrupted_help = true;
-                return {};
-            }
-        
-            fileNameLen = 0;
-            for(int i = 0; i < 8; i++)
-                fileNameLen = fileNameLen * 2 + (binary[binaryPos++] == '1');
+            fileNameLen = static_cast<uint8_t>(reader.Read(8));
 
             continue;
         }
@@ -361,41 +859,27 @@ vector<pair<string, bool>> GetCompressedFilesWithFile(ifstream &file) {
         if(newFilePath[newFilePath.length() - 1] != '/')
             newFilePath += "/";
 
-        if(binaryPos + 8 * fileNameLen + 1 >= binaryLength)
-            ReadDataToDecompress(binary, file, binaryLength, binaryPos);
-
-        if(binaryPos + 8 * fileNameLen + 1 >= binaryLength) {
-            archive_corrupted_help = true;
-            return {};
-        }
-
-        for(int i = 0; i < fileNameLen; i++) {
-            char tempVal = 0;
-            for(int j = 0; j < 8; j++)
-                tempVal = tempVal * 2 + (binary[binaryPos + j] == '1');
-        
-            binaryPos += 8;
-            newFilePath += tempVal;
-        }
+        for(int i = 0; i < fileNameLen; i++)
+            newFilePath += static_cast<char>(reader.Read(8));
 
-        if(binary[binaryPos] == '0')
+        bool isFile = reader.Read(1);
+        if(!isFile)
             folderAddress = newFilePath;
-        addresses.push_back({newFilePath, binary[binaryPos++] == '1'});
+        addresses.push_back({newFilePath, isFile});
 
-        if(8 + binaryPos >= binaryLength)
-            ReadDataToDecompress(binary, file, binaryLength, binaryPos);
+        fileNameLen = static_cast<uint8_t>(reader.Read(8));
+    }
 
-        if(8 + binaryPos >= binaryLength) {
-            archive_corrupted_help = true;
-            return {};
-        }
-        
-        fileNameLen = 0;
-        for(int i = 0; i < 8; i++)
-            fileNameLen = fileNameLen * 2 + (binary[binaryPos++] == '1');
+    if(reader.Overrun()) {
+        archive_corrupted_help = true;
+        return {};
     }
 
-    bytesFromTheLastRead = binary.substr(binaryPos);
+    if(archiveHeader.version >= DIRECTORY_VERSION) {
+        ReadDirectoryEntries(reader, count_if(addresses.begin(), addresses.end(), [](const pair<string, bool> &i) { return i.second; }));
+        if(archive_corrupted_help)
+            return {};
+    }
 
     return addresses;
 }
@@ -409,9 +893,8 @@ vector<pair<string, bool>> GetCompressedFiles(const string &compressedFileAddres
         return {};
     }
 
-    vector<pair<string, bool>> addresses; // 1 - file; 0 - folder
-
-    addresses = GetCompressedFilesWithFile(file);
+    BitReader reader(file);
+    vector<pair<string, bool>> addresses = GetCompressedFilesWithFile(reader); // 1 - file; 0 - folder
 
     file.close();
 
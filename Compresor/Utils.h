@@ -2,30 +2,230 @@
 
 #include "Globals.h"
 #include <cstdint>
+#include <cstring>
 
 bool FileExists(string filename);
 
 bool is_directory(const std::string& path);
 
-uint32_t Hash(unsigned char buffer[], const int &bufferIdx, const int SIZE = WINDOW_SIZE);
+//hash of the HASH_BYTES bytes at bytes, HASH_BITS wide: one multiplication, no division
+template<int HASH_BITS, int HASH_BYTES>
+inline uint32_t Hash(const unsigned char *bytes) {
+    static_assert(HASH_BYTES == 3 || HASH_BYTES == 4, "only 3 or 4 bytes are hashed");
+    static_assert(HASH_BITS > 0 && HASH_BITS <= 24, "the hash chain heads must fit in memory");
+
+    uint32_t value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16);
+    if(HASH_BYTES == 4)
+        value |= static_cast<uint32_t>(bytes[3]) << 24;
+
+    return (value * HASH_MULTIPLIER) >> (32 - HASH_BITS);
+}
+
+void ResetHashChain(HashChain &chain, const int &hashBits, const uint64_t &windowSize, const bool &binaryTree = false);
+void InsertHashChain(HashChain &chain, const uint32_t &h, const uint64_t &pos);
+
+int BitsNeeded(uint32_t value);
+
+int MatchLength(const unsigned char *match, const unsigned char *scan, const int &limit);
 
 void ReadDataToCompress(unsigned char bytes[], int &bytesLength, int &bytesLengthIdx, ifstream &file);
 
-int ReadDataFromBuffer(unsigned char buffer[], int &bufferIdx, int &bufferByteIdx, int &bufferSize, ifstream &inputFile, uint8_t size = 8);
-int ReadDataFromBufferBig(unsigned char buffer[], int &bufferIdx, int &bufferByteIdx, int &bufferSize, ifstream &inputFile, uint8_t size = 32);
-LZ77 ReadTokenFromBuffer(unsigned char buffer[],  int &bufferIdx, int &bufferByteIdx, int &bufferSize, ifstream &inputFile);
+uint32_t PackToken(const LZ77 &token);
+LZ77 UnpackToken(const uint32_t &token);
+
+void ClearTokenBuffer(TokenBuffer &buffer);
+void PushToken(TokenBuffer &buffer, const uint32_t &token);
+void RewindTokenBuffer(TokenBuffer &buffer);
+bool NextToken(TokenBuffer &buffer, uint32_t &token);
+
+//collects bits msb first in a 64-bit accumulator and writes whole words into a large buffer, one writer per stream
+class BitWriter {
+public:
+    static constexpr int MAX_PUT_BITS = 57; //the accumulator always has room for this many bits after a flush
+
+    //start - how many bytes the stream already has before the ones put here, Position counts from its beginning
+    explicit BitWriter(ostream &stream, uint64_t start = 0);
+
+    //writes the low size bits of value
+    inline void Put(const uint64_t &value, const int &size) {
+        if(size == 0)
+            return;
+
+        if(count + size > 64)
+            FlushBits();
+
+        bits |= (value << (64 - size)) >> count;
+        count += size;
+    }
+
+    void PutBytes(const unsigned char *bytes, size_t size);
+
+    //pads with 0 bits up to the next byte
+    inline void Align() {
+        Put(0, (8 - count % 8) % 8);
+    }
+
+    //writes every whole byte to the stream, less than 8 bits stay in the accumulator
+    void Flush();
+    //pads the last byte with 0 bits and writes everything
+    void Finish();
+
+    int PendingBits() const { return count; }
+    unsigned char PendingByte() const { return count == 0 ? 0 : static_cast<unsigned char>(bits >> (64 - count)); }
+
+    //how many bits were put so far
+    uint64_t Position() const { return (written + used) * 8 + count; }
+
+    //at a byte: writes everything down to the file, so that the next bytes can be written to it through another handle
+    void Sync();
+    //after Sync: the next size bytes were written to the file through another handle
+    void Skip(uint64_t size);
+
+private:
+    //moves the whole bytes of the accumulator into the buffer, the buffer keeps 8 spare bytes so a whole word is stored at once
+    inline void FlushBits() {
+        uint64_t word = __builtin_bswap64(bits);
+        memcpy(&buffer[used], &word, sizeof(word));
+
+        int whole = count & ~7;
+        used += whole >> 3;
+        bits = whole == 64 ? 0 : bits << whole;
+        count -= whole;
+
+        if(used >= WRITE_BUFFER_SIZE)
+            WriteBuffer();
+    }
+
+    void WriteBuffer();
+
+    ostream &stream;
+    vector<unsigned char> buffer;
+    size_t used = 0;
+    uint64_t written = 0; //bytes already in the stream
+    uint64_t bits = 0;
+    int count = 0;
+};
+
+void WriteStreamToBuffer(BitWriter &writer, const CompressedStream &stream);
+//flushes writer, everything put in it is taken from stream
+CompressedStream TakeStream(BitWriter &writer, const ostringstream &stream);
+
+//reads bits msb first through a 64-bit window that is refilled from a large buffer, one reader per stream
+class BitReader {
+public:
+    static constexpr int MAX_PEEK_BITS = 56; //the window always holds at least this many bits after a refill
+
+    explicit BitReader(istream &stream);
+
+    //the next size bits, without consuming them; past the end of the stream the bits read as 0
+    inline uint64_t Peek(const int &size) {
+        if(count < size)
+            Refill();
+
+        return size == 0 ? 0 : window >> (64 - size);
+    }
+
+    //drops size bits that were peeked
+    inline void Consume(const int &size) {
+        window <<= size;
+        count -= size;
+    }
+
+    inline uint64_t Read(const int &size) {
+        uint64_t value = Peek(size);
+        Consume(size);
+
+        return value;
+    }
+
+    //the fast decoding loop runs while the buffer holds this many bytes, so that two refills never reach its end
+    static constexpr size_t FAST_REFILL_MARGIN = 2 * sizeof(uint64_t);
+
+    bool CanRefillFast() const { return end - pos >= FAST_REFILL_MARGIN; }
+
+    //tops up the window to at least MAX_PEEK_BITS bits with a whole word, only while CanRefillFast
+    inline void RefillFast() {
+        if(count >= MAX_PEEK_BITS)
+            return;
+
+        uint64_t word;
+        memcpy(&word, &buffer[pos], sizeof(word));
+        window |= __builtin_bswap64(word) >> count;
+
+        int bytes = (63 - count) >> 3;
+        pos += bytes;
+        count += bytes * 8;
+    }
+
+    //the next size bits (0 - MAX_PEEK_BITS) with no check, the window must already hold them
+    inline uint64_t PeekFast(const int &size) const {
+        return (window >> 1) >> (63 - size);
+    }
+
+    void ReadBytes(unsigned char *bytes, size_t size);
+    void SkipBits(uint64_t bits);
+    void CopyBits(uint64_t bits, BitWriter &writer);
+
+    //the next bit read is bit of the stream, counted from its start
+    void Seek(uint64_t bit);
+    uint64_t StreamSize();
+
+    //true once more bits were read than the stream has
+    bool Overrun() const { return truncated || count < padding; }
+
+private:
+    void Refill();
+    bool FillBuffer();
+    //empties the window, only whole bytes of the buffer are read after it
+    void DropWindow();
+
+    istream &stream;
+    vector<unsigned char> buffer;
+    size_t pos = 0, end = 0;
+    uint64_t window = 0;
+    int count = 0;
+    int64_t padding = 0; //the 0 bits added to the window after the end of the stream
+    bool truncated = false;
+};
+
+//passes everything written to another stream buffer and keeps its size and CRC-32
+class ChecksumBuffer : public streambuf {
+public:
+    explicit ChecksumBuffer(streambuf *target) : target(target) {}
+
+    uint32_t Checksum() const { return checksum; }
+    uint64_t Size() const { return size; }
+
+protected:
+    streamsize xsputn(const char *bytes, streamsize count) override;
+    int_type overflow(int_type c) override;
+
+private:
+    streambuf *target;
+    uint32_t checksum = 0;
+    uint64_t size = 0;
+};
+
+uint32_t Crc32(uint32_t crc, const unsigned char *bytes, size_t size);
+//the CRC-32 of two parts from the CRC-32 of each, size2 is the length of the second part
+uint32_t Crc32Combine(uint32_t crc1, uint32_t crc2, uint64_t size2);
+
+uint32_t CloneClusterSize(const string &from, const string &to);
+bool CopyFileRange(const string &from, const uint64_t &fromOffset, const string &to, const uint64_t &toOffset, const uint64_t &size, const uint32_t &cluster);
 
-void WriteToBuffer(ofstream &file, const unsigned char &byte, uint8_t size = 8);
-void WriteToBufferBig(ofstream &outFile, const long long &byte, uint8_t size = 64);
+void WriteTokenToFile(LZ77 &token, unsigned char compressedBytes[], int &compressedBytesIdx, const int &windowSize, ostream &file);
+void FlushDecompressedBytes(unsigned char compressedBytes[], const int &compressedBytesIdx, const int &windowSize, ostream &file);
 
-void WriteToBuffer_2(ofstream &file, const unsigned char &byte, uint8_t size = 8);
-void WriteToBufferBig_2(ofstream &outFile, const long long &byte, uint8_t size = 64);
+void ReadStoredBytes(BitReader &reader, uint64_t size, unsigned char decompressedBytes[], int &decompressedBytesIdx, const int &windowSize, ostream &outFile);
 
-void WriteTokenToFile(LZ77 &token, unsigned char compressedBytes[], int &compressedBytesIdx, ofstream &file);
+void WriteArchiveHeader(BitWriter &writer, const ArchiveHeader &header);
+bool ReadArchiveHeader(BitReader &reader, ArchiveHeader &header);
 
-void ReadDataToDecompress(string &s, ifstream &file, int &binaryLength, int &binaryPos);
+void WriteDirectory(BitWriter &writer, const CompressedStream &names, const vector<DirectoryEntry> &entries);
+bool SeekDirectory(BitReader &reader);
+void ReadDirectoryEntries(BitReader &reader, const size_t &files);
 
-vector<pair<string, bool>> GetCompressedFilesWithFile(ifstream &file);
+vector<pair<string, bool>> GetCompressedFilesWithFile(BitReader &reader);
 vector<pair<string, bool>> GetCompressedFiles(const string &compressedFileAddress);
 
 int CompareBinaryFiles(const string& file1, const string& file2);
\ No newline at end of file